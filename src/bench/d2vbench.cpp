@@ -0,0 +1,643 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Standalone benchmark for the decoding core, without VapourSynth.
+ * It parses a D2V and decodes frames from it in a number of access
+ * patterns, and prints the results as JSON on stdout.
+ *
+ * With --verify, every frame is first decoded linearly and hashed,
+ * and each frame decoded by the access patterns is checked against
+ * those hashes, to catch seeks which return the wrong picture.
+ *
+ * Allocations made through C++ operator new while decoding the second
+ * half of each mode are counted, so per-frame allocations creeping back
+ * into the decoding path show up, and with --check-allocs, fail the run
+ * if the linear mode makes any. Allocations made by FFmpeg itself are
+ * not counted.
+ *
+ * With --sources, random frames are also decoded from several sources at
+ * once, to measure latency when decoders compete for the CPU.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "d2v.hpp"
+#include "decode.hpp"
+#include "gop.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+typedef std::chrono::steady_clock benchclock;
+
+static const char *modes[] = { "linear", "random", "reverse", "strided", "opengop" };
+
+static std::atomic<int64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void *ret = malloc(size ? size : 1);
+    if (!ret)
+        throw std::bad_alloc();
+
+    return ret;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: d2vbench [options] input.d2v\n"
+        "\n"
+        "Options:\n"
+        "    --mode <name>   Only run one mode: linear, random, reverse, strided or opengop.\n"
+        "    --count <n>     Number of frames to decode per mode. Default is 1000.\n"
+        "    --stride <n>    Step between frames in strided mode. Default is 25.\n"
+        "    --seed <n>      Seed for random mode. Default is 0.\n"
+        "    --threads <n>   Number of threads FFmpeg should use. Default is 0 (auto).\n"
+        "    --packet-cache <MiB>  Size of the demuxed packet cache. Default is 0 (off).\n"
+        "    --prefilter     Hide non-video streams from libavformat.\n"
+        "    --io-hints      Give the kernel readahead and page cache hints.\n"
+        "    --verify        Check every decoded frame against a linear decode of the whole file.\n"
+        "    --check-allocs  Fail if the linear mode allocates once it is warmed up.\n"
+        "    --sources <n>   Also decode random frames from n sources at once, one thread each.\n"
+        "    --baseline <file>  Compare the fps of every mode against a baseline recorded earlier.\n"
+        "    --tolerance <n> How much slower than the baseline a mode may be, as a fraction. Default is 0.25.\n"
+        "    --record        Write the fps of every mode to the baseline file, instead of comparing.\n");
+}
+
+static double elapsed(benchclock::time_point start)
+{
+    return std::chrono::duration<double>(benchclock::now() - start).count();
+}
+
+static int64_t peak_rss(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return -1;
+
+    return (int64_t) pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage))
+        return -1;
+
+#ifdef __APPLE__
+    return (int64_t) usage.ru_maxrss;
+#else
+    return (int64_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static std::string json_escape(const char *str)
+{
+    std::string ret;
+
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            ret += '\\';
+        ret += *str;
+    }
+
+    return ret;
+}
+
+/* FNV-1a hash of the visible area of a decoded frame. */
+static uint64_t hash_frame(const d2vcontext *d2v, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat) frame->format);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    if (!desc)
+        return 0;
+
+    int bytes  = desc->comp[0].depth > 8 ? 2 : 1;
+    int planes = av_pix_fmt_count_planes((enum AVPixelFormat) frame->format);
+
+    for (int p = 0; p < planes; p++) {
+        int width  = p ? AV_CEIL_RSHIFT(d2v->width, desc->log2_chroma_w) : d2v->width;
+        int height = p ? AV_CEIL_RSHIFT(d2v->height, desc->log2_chroma_h) : d2v->height;
+
+        for (int y = 0; y < height; y++) {
+            const uint8_t *line = frame->data[p] + (ptrdiff_t) y * frame->linesize[p];
+
+            for (int x = 0; x < width * bytes; x++) {
+                hash ^= line[x];
+                hash *= 0x100000001B3ULL;
+            }
+        }
+    }
+
+    return hash;
+}
+
+/* Decode every frame linearly, and stash its hash. */
+static bool hash_linear(d2vcontext *d2v, int threads, std::vector<uint64_t>& hashes)
+{
+    std::string err;
+
+    std::unique_ptr<decodecontext> dec(decodeinit(d2v, threads, err));
+    if (!dec) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Cannot allocate AVFrame.\n");
+        return false;
+    }
+
+    hashes.resize(d2v->frames.size());
+
+    for (size_t i = 0; i < d2v->frames.size(); i++) {
+        if (decodeframe((int) i, d2v, dec.get(), frame, err) < 0) {
+            fprintf(stderr, "Frame %zu: %s\n", i, err.c_str());
+            av_frame_free(&frame);
+            return false;
+        }
+
+        hashes[i] = hash_frame(d2v, frame);
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+
+    return true;
+}
+
+/* Build the list of frames to decode for a given access pattern. */
+static std::vector<int> build_pattern(const d2vcontext *d2v, const std::string& mode, int count, int stride, unsigned int seed)
+{
+    std::vector<int> ret;
+    int num_frames = (int) d2v->frames.size();
+
+    if (mode == "linear") {
+        for (int i = 0; i < std::min(count, num_frames); i++)
+            ret.push_back(i);
+    } else if (mode == "random") {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> dist(0, num_frames - 1);
+
+        for (int i = 0; i < count; i++)
+            ret.push_back(dist(rng));
+    } else if (mode == "reverse") {
+        for (int i = num_frames - 1; i >= 0 && (int) ret.size() < count; i--)
+            ret.push_back(i);
+    } else if (mode == "strided") {
+        for (int i = 0; i < num_frames && (int) ret.size() < count; i += stride)
+            ret.push_back(i);
+    } else if (mode == "opengop") {
+        /*
+         * The first frame of every other open GOP, which always
+         * needs the previous GOP decoded as well.
+         */
+        for (size_t i = 0; i < d2v->frames.size() && (int) ret.size() < count; i++) {
+            const frame& f = d2v->frames[i];
+
+            if (f.offset || f.gop == 0 || (f.gop & 1) || (d2v->gops[f.gop].info & GOP_FLAG_CLOSED))
+                continue;
+
+            ret.push_back((int) i);
+        }
+    }
+
+    return ret;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+
+    std::sort(values.begin(), values.end());
+
+    size_t idx = (size_t) (p * (double) (values.size() - 1) + 0.5);
+
+    return values[idx];
+}
+
+/* Read a whole file into a string. Returns false if it can't be read. */
+static bool read_file(const char *path, std::string& out)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> in(fopen(path, "rb"), &fclose);
+    if (!in)
+        return false;
+
+    char buf[4096];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), in.get())) > 0)
+        out.append(buf, size);
+
+    return true;
+}
+
+/* Find the fps of a mode in a baseline file, or -1 if it isn't there. */
+static double baseline_fps(const std::string& baseline, const char *mode)
+{
+    size_t pos = baseline.find("\"fps\": {");
+    if (pos == std::string::npos)
+        return -1.0;
+
+    std::string key = std::string("\"") + mode + "\": ";
+
+    pos = baseline.find(key, pos);
+    if (pos == std::string::npos)
+        return -1.0;
+
+    return strtod(baseline.c_str() + pos + key.length(), NULL);
+}
+
+static bool run_mode(d2vcontext *d2v, const std::string& mode, int count, int stride, unsigned int seed, int threads,
+                     const decodeoptions *opts, const std::vector<uint64_t>& hashes, bool first, int *mismatches,
+                     double *fps, int64_t *allocs)
+{
+    std::string err;
+
+    std::vector<int> pattern = build_pattern(d2v, mode, count, stride, seed);
+
+    std::unique_ptr<decodecontext> dec(decodeinit(d2v, threads, err, opts));
+    if (!dec) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        fprintf(stderr, "Cannot allocate AVFrame.\n");
+        return false;
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(pattern.size());
+
+    int mode_mismatches = 0;
+
+    /* The first half of the pattern warms up the decoder and its caches. */
+    size_t steady_start = pattern.size() / 2;
+    int64_t steady_allocs = 0;
+
+    for (size_t i = 0; i < pattern.size(); i++) {
+        benchclock::time_point frame_start = benchclock::now();
+        int64_t allocs_before = allocations.load(std::memory_order_relaxed);
+
+        if (decodeframe(pattern[i], d2v, dec.get(), frame, err) < 0) {
+            fprintf(stderr, "Frame %d: %s\n", pattern[i], err.c_str());
+            av_frame_free(&frame);
+            return false;
+        }
+
+        if (i >= steady_start)
+            steady_allocs += allocations.load(std::memory_order_relaxed) - allocs_before;
+
+        latencies.push_back(elapsed(frame_start) * 1000.0);
+
+        /* Hashing isn't counted towards the per-frame latency. */
+        if (!hashes.empty() && hash_frame(d2v, frame) != hashes[pattern[i]]) {
+            fprintf(stderr, "%s: frame %d does not match linear decode.\n", mode.c_str(), pattern[i]);
+            mode_mismatches++;
+        }
+
+        av_frame_unref(frame);
+    }
+
+    double total = 0.0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        total += latencies[i] / 1000.0;
+
+    av_frame_free(&frame);
+
+    *fps = total > 0.0 ? (double) pattern.size() / total : 0.0;
+
+    printf("%s\n    {\"mode\": \"%s\", \"frames\": %zu, \"time\": %.6f, \"fps\": %.3f, "
+           "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"seeks\": %lld, \"packet_cache_hits\": %lld, \"discarded\": %lld, "
+           "\"bytes_read\": %lld, \"steady_allocs\": %lld, \"mismatches\": %d}",
+           first ? "" : ",", mode.c_str(), pattern.size(), total, *fps,
+           percentile(latencies, 0.5), percentile(latencies, 0.99),
+           (long long) dec->stats.seeks, (long long) dec->stats.packet_cache_hits, (long long) dec->stats.frames_discarded,
+           (long long) dec->stats.bytes_read, (long long) steady_allocs, mode_mismatches);
+
+    *mismatches += mode_mismatches;
+    *allocs      = steady_allocs;
+
+    return true;
+}
+
+/*
+ * Decode random frames from several sources at once, each with its own
+ * D2V and decoder on its own thread, as a script with many sources does.
+ * Latencies are taken over the frames of all sources, and fps is their
+ * combined throughput.
+ */
+static bool run_concurrent(const char *input, int sources, int count, unsigned int seed, int threads,
+                           const decodeoptions *opts, bool first, double *fps)
+{
+    std::vector<std::vector<double>> latencies(sources);
+    std::vector<std::string> errors(sources);
+    std::vector<char> done(sources, 0);
+    std::vector<std::thread> workers;
+
+    benchclock::time_point start = benchclock::now();
+
+    for (int s = 0; s < sources; s++) {
+        workers.emplace_back([&, s]() {
+            std::string& err = errors[s];
+
+            std::unique_ptr<d2vcontext> d2v(d2vparse(input, err));
+            if (!d2v)
+                return;
+
+            std::unique_ptr<decodecontext> dec(decodeinit(d2v.get(), threads, err, opts));
+            if (!dec)
+                return;
+
+            AVFrame *frame = av_frame_alloc();
+            if (!frame) {
+                err = "Cannot allocate AVFrame.";
+                return;
+            }
+
+            std::vector<int> pattern = build_pattern(d2v.get(), "random", count, 1, seed + s);
+            latencies[s].reserve(pattern.size());
+
+            for (int n : pattern) {
+                benchclock::time_point frame_start = benchclock::now();
+
+                if (decodeframe(n, d2v.get(), dec.get(), frame, err) < 0) {
+                    err.insert(0, "Frame " + std::to_string(n) + ": ");
+                    av_frame_free(&frame);
+                    return;
+                }
+
+                latencies[s].push_back(elapsed(frame_start) * 1000.0);
+                av_frame_unref(frame);
+            }
+
+            av_frame_free(&frame);
+            done[s] = 1;
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    double total = elapsed(start);
+
+    std::vector<double> all;
+    for (int s = 0; s < sources; s++) {
+        if (!done[s]) {
+            fprintf(stderr, "Source %d: %s\n", s, errors[s].c_str());
+            return false;
+        }
+
+        all.insert(all.end(), latencies[s].begin(), latencies[s].end());
+    }
+
+    *fps = total > 0.0 ? (double) all.size() / total : 0.0;
+
+    printf("%s\n    {\"mode\": \"concurrent\", \"sources\": %d, \"frames\": %zu, \"time\": %.6f, \"fps\": %.3f, "
+           "\"p50_ms\": %.3f, \"p99_ms\": %.3f}",
+           first ? "" : ",", sources, all.size(), total, *fps, percentile(all, 0.5), percentile(all, 0.99));
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *input    = NULL;
+    const char *only     = NULL;
+    const char *baseline = NULL;
+    double tolerance     = 0.25;
+    bool record          = false;
+    int count            = 1000;
+    int stride        = 25;
+    int threads       = 0;
+    int packet_cache  = 0;
+    int sources       = 0;
+    unsigned int seed = 0;
+    bool verify       = false;
+    bool check_allocs = false;
+    bool prefilter    = false;
+    bool io_hints     = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--mode") && has_arg) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "--count") && has_arg) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--stride") && has_arg) {
+            stride = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && has_arg) {
+            seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--threads") && has_arg) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--packet-cache") && has_arg) {
+            packet_cache = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--prefilter")) {
+            prefilter = true;
+        } else if (!strcmp(argv[i], "--io-hints")) {
+            io_hints = true;
+        } else if (!strcmp(argv[i], "--verify")) {
+            verify = true;
+        } else if (!strcmp(argv[i], "--check-allocs")) {
+            check_allocs = true;
+        } else if (!strcmp(argv[i], "--sources") && has_arg) {
+            sources = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--baseline") && has_arg) {
+            baseline = argv[++i];
+        } else if (!strcmp(argv[i], "--tolerance") && has_arg) {
+            tolerance = strtod(argv[++i], NULL);
+        } else if (!strcmp(argv[i], "--record")) {
+            record = true;
+        } else if (argv[i][0] != '-' && !input) {
+            input = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    /* Packets stored in the packet cache are allocated, so it can't be checked. */
+    if (!input || count <= 0 || stride <= 0 || threads < 0 || packet_cache < 0 || sources < 0 ||
+        tolerance < 0.0 || tolerance >= 1.0 || (record && !baseline) || (check_allocs && packet_cache)) {
+        usage();
+        return 1;
+    }
+
+    if (only && std::find_if(std::begin(modes), std::end(modes),
+                             [only](const char *m) { return !strcmp(m, only); }) == std::end(modes)) {
+        usage();
+        return 1;
+    }
+
+    /*
+     * Baselines are specific to the machine they were recorded on, so a
+     * missing one is reported as a skipped test (77) rather than a failure.
+     */
+    std::string baseline_json;
+    if (baseline && !record && !read_file(baseline, baseline_json)) {
+        fprintf(stderr, "No baseline at %s; record one with --record.\n", baseline);
+        return 77;
+    }
+
+    std::string err;
+
+    decodeoptions opts = {};
+    opts.packet_cache_size = (int64_t) packet_cache << 20;
+    opts.prefilter         = prefilter;
+    opts.io_hints          = io_hints;
+
+    benchclock::time_point parse_start = benchclock::now();
+    std::unique_ptr<d2vcontext> d2v(d2vparse(input, err));
+    double parse_time = elapsed(parse_start);
+
+    if (!d2v) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+
+    std::vector<uint64_t> hashes;
+    if (verify && !hash_linear(d2v.get(), threads, hashes))
+        return 1;
+
+    printf("{\n  \"input\": \"%s\",\n  \"frames\": %zu,\n  \"gops\": %zu,\n  \"parse_time\": %.6f,\n  \"modes\": [",
+           json_escape(input).c_str(), d2v->frames.size(), d2v->gops.size(), parse_time);
+
+    bool first      = true;
+    int mismatches  = 0;
+    int regressions = 0;
+    int64_t linear_allocs = 0;
+    std::string recorded;
+
+    /* Record or check the fps of a mode against the baseline. */
+    auto track = [&](const char *mode, double fps) {
+        if (record) {
+            char entry[128];
+            snprintf(entry, sizeof(entry), "%s\"%s\": %.3f", recorded.empty() ? "" : ", ", mode, fps);
+            recorded += entry;
+        } else if (baseline) {
+            double expected = baseline_fps(baseline_json, mode);
+
+            if (expected > 0.0 && fps < expected * (1.0 - tolerance)) {
+                fprintf(stderr, "%s: %.3f fps is more than %.0f%% below the baseline of %.3f fps.\n",
+                        mode, fps, tolerance * 100.0, expected);
+                regressions++;
+            }
+        }
+    };
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (only && strcmp(only, modes[i]))
+            continue;
+
+        double fps;
+        int64_t allocs;
+        if (!run_mode(d2v.get(), modes[i], count, stride, seed, threads, &opts, hashes, first, &mismatches, &fps, &allocs))
+            return 1;
+
+        if (!strcmp(modes[i], "linear"))
+            linear_allocs = allocs;
+
+        track(modes[i], fps);
+
+        first = false;
+    }
+
+    if (sources) {
+        double fps;
+        if (!run_concurrent(input, sources, count, seed, threads, &opts, first, &fps))
+            return 1;
+
+        track("concurrent", fps);
+    }
+
+    printf("\n  ],\n  \"peak_rss\": %lld\n}\n", (long long) peak_rss());
+
+    if (record) {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(baseline).parent_path(), ec);
+
+        std::unique_ptr<FILE, decltype(&fclose)> out(fopen(baseline, "wb"), &fclose);
+
+        if (!out || fprintf(out.get(), "{\n  \"input\": \"%s\",\n  \"count\": %d,\n  \"fps\": {%s}\n}\n",
+                            json_escape(input).c_str(), count, recorded.c_str()) < 0) {
+            fprintf(stderr, "Cannot write baseline to %s.\n", baseline);
+            return 1;
+        }
+    }
+
+    if (mismatches)
+        return 2;
+
+    if (regressions)
+        return 3;
+
+    if (check_allocs && linear_allocs) {
+        fprintf(stderr, "linear: %lld allocations after warm-up, expected none.\n", (long long) linear_allocs);
+        return 4;
+    }
+
+    return 0;
+}
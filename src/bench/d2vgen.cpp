@@ -0,0 +1,736 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Generator for the synthetic stream corpus d2vbench is tested with.
+ *
+ * Each case is a short MPEG-1 or MPEG-2 stream, encoded with libavcodec
+ * and muxed with libavformat as an elementary, program or transport
+ * stream, which may be split into several files. The stream is then
+ * indexed the way DGIndex does it, from its start codes, and a D2V is
+ * written next to it.
+ *
+ * libavcodec can't encode repeated fields itself, so soft telecined
+ * cases are encoded as progressive frames, and then have their flags
+ * rewritten in place to a 3:2 cadence. Only single bits change, so the
+ * rest of the bitstream stays valid.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+#include "d2v.hpp"
+#include "gop.hpp"
+
+namespace fs = std::filesystem;
+
+/* PID of the video stream in transport stream cases. */
+#define GEN_TS_PID 0x1011
+
+typedef struct gencase {
+    const char *name;
+    enum streamtype stream_type;
+    int mpeg_type;
+    int width;
+    int height;
+    int frames;
+    int gop_size;
+    int b_frames;
+    bool closed_gop;
+    bool interlaced; // Field DCT and motion estimation, top field first.
+    bool rff;        // Progressive frames with a 3:2 soft telecine cadence.
+    int files;
+} gencase;
+
+/*
+ * The corpus. Keep the names in sync with bench_cases in meson.build.
+ * Sizes which aren't multiples of 16 and 32 exercise cropping of the
+ * aligned decoder buffers.
+ */
+static const gencase cases[] = {
+    /* name                   type        MPEG  width height frames GOP  B  closed interlaced rff   files */
+    { "es_mpeg1_closed",      ELEMENTARY, 1,    352,  240,   240,   12,  2, true,  false,     false, 1 },
+    { "es_mpeg2_open",        ELEMENTARY, 2,    720,  480,   240,   15,  2, false, true,      false, 1 },
+    { "es_mpeg2_rff_odd",     ELEMENTARY, 2,    350,  238,   240,   12,  2, false, false,     true,  1 },
+    { "ps_mpeg1_open",        PROGRAM,    1,    352,  240,   240,   15,  2, false, false,     false, 1 },
+    { "ps_mpeg2_open_split",  PROGRAM,    2,    720,  480,   240,   15,  2, false, true,      false, 3 },
+    { "ps_mpeg2_rff",         PROGRAM,    2,    720,  480,   240,   12,  2, false, false,     true,  1 },
+    { "ts_mpeg2_closed_odd",  TRANSPORT,  2,    350,  238,   240,   15,  2, true,  true,      false, 1 },
+    { "ts_mpeg2_open_split",  TRANSPORT,  2,    720,  576,   240,   12,  3, false, false,     true,  4 },
+};
+
+/* A picture as found in the elementary stream. */
+typedef struct genpicture {
+    int64_t display; // Frame number in display order, from the encoder.
+    int type;        // 1 = I, 2 = P, 3 = B, as in the picture header.
+    bool tff;
+    bool rff;
+    bool progressive;
+} genpicture;
+
+typedef struct gengop {
+    int64_t es_pos; // Of its sequence header, or GOP header if it has none.
+    bool closed;
+    bool progressive_sequence;
+    std::vector<genpicture> pictures; // In coded order.
+} gengop;
+
+/* Where a run of elementary stream bytes came from in the muxed stream. */
+typedef struct genchunk {
+    int64_t es_pos;
+    int64_t pos;
+} genchunk;
+
+typedef struct genmemory {
+    const std::vector<uint8_t> *data;
+    int64_t pos;
+} genmemory;
+
+static int genread(void *opaque, uint8_t *buf, int size)
+{
+    genmemory *m = (genmemory *) opaque;
+    int64_t left = (int64_t) m->data->size() - m->pos;
+
+    if (left <= 0)
+        return AVERROR_EOF;
+
+    size = (int) std::min<int64_t>(size, left);
+    memcpy(buf, m->data->data() + m->pos, size);
+    m->pos += size;
+
+    return size;
+}
+
+static int64_t genseek(void *opaque, int64_t offset, int whence)
+{
+    genmemory *m = (genmemory *) opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return (int64_t) m->data->size();
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += m->pos;
+        break;
+    case SEEK_END:
+        offset += (int64_t) m->data->size();
+        break;
+    default:
+        return -1;
+    }
+
+    if (offset < 0 || offset > (int64_t) m->data->size())
+        return -1;
+
+    m->pos = offset;
+
+    return offset;
+}
+
+static FILE *genopen(const fs::path& path, const char *mode)
+{
+#ifdef _WIN32
+    std::wstring wmode(mode, mode + strlen(mode));
+    return _wfopen(path.c_str(), wmode.c_str());
+#else
+    return fopen(path.c_str(), mode);
+#endif
+}
+
+/* A deterministic moving picture, different in every frame. */
+static void genfill(AVFrame *frame, int n)
+{
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *line = frame->data[0] + (ptrdiff_t) y * frame->linesize[0];
+
+        for (int x = 0; x < frame->width; x++) {
+            bool box = x - n * 3 > 40 && x - n * 3 < 120 && y - n > 20 && y - n < 90;
+            line[x]  = box ? 235 : (uint8_t) (16 + ((x * 2 + y + n * 5) & 0x7F) + (((x >> 3) ^ (y >> 3)) & 1) * 32);
+        }
+    }
+
+    for (int p = 1; p < 3; p++) {
+        for (int y = 0; y < AV_CEIL_RSHIFT(frame->height, 1); y++) {
+            uint8_t *line = frame->data[p] + (ptrdiff_t) y * frame->linesize[p];
+
+            for (int x = 0; x < AV_CEIL_RSHIFT(frame->width, 1); x++)
+                line[x] = (uint8_t) (64 + ((p == 1 ? x : y) + n * 2) % 128);
+        }
+    }
+}
+
+/*
+ * Rewrite the field flags of an encoded picture: top field first for
+ * interlaced cases, and the 3:2 cadence, by display order, for soft
+ * telecined ones. Those also need progressive_sequence cleared, since
+ * repeated fields mean repeated frames in a progressive sequence.
+ */
+static void genpatch(AVPacket *pkt, const gencase *c, int64_t display_num)
+{
+    static const bool cadence_tff[4] = { true, false, false, true };
+    static const bool cadence_rff[4] = { true, false, true, false };
+
+    uint8_t *data = pkt->data;
+
+    for (int i = 0; i + 8 < pkt->size; i++) {
+        if (data[i] || data[i + 1] || data[i + 2] != 1 || data[i + 3] != 0xB5)
+            continue;
+
+        int id = data[i + 4] >> 4;
+
+        if (id == 1 && c->rff) {
+            data[i + 5] &= ~0x08;
+        } else if (id == 8 && c->interlaced) {
+            data[i + 7] |= 0x80;
+        } else if (id == 8 && c->rff) {
+            int phase = (int) (display_num % 4);
+
+            data[i + 7] &= ~0x82;
+            data[i + 7] |= (cadence_tff[phase] ? 0x80 : 0) | (cadence_rff[phase] ? 0x02 : 0);
+        }
+    }
+}
+
+static bool genencode(const gencase *c, AVCodecContext **out_enc, std::vector<AVPacket *>& packets, std::string& err)
+{
+    const AVCodec *codec = avcodec_find_encoder(c->mpeg_type == 1 ? AV_CODEC_ID_MPEG1VIDEO : AV_CODEC_ID_MPEG2VIDEO);
+    if (!codec) {
+        err = "libavcodec was built without the MPEG video encoders.";
+        return false;
+    }
+
+    AVCodecContext *enc = avcodec_alloc_context3(codec);
+    if (!enc) {
+        err = "Cannot allocate AVCodecContext.";
+        return false;
+    }
+    *out_enc = enc;
+
+    enc->width          = c->width;
+    enc->height         = c->height;
+    enc->pix_fmt        = AV_PIX_FMT_YUV420P;
+    enc->time_base      = { 1001, 30000 };
+    enc->framerate      = { 30000, 1001 };
+    enc->gop_size       = c->gop_size;
+    enc->max_b_frames   = c->b_frames;
+    enc->flags         |= AV_CODEC_FLAG_QSCALE;
+    enc->global_quality = FF_QP2LAMBDA * 6;
+
+    if (c->mpeg_type == 2)
+        enc->colorspace = AVCOL_SPC_SMPTE170M;
+    if (c->closed_gop)
+        enc->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    if (c->interlaced)
+        enc->flags |= AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME;
+
+    /* Only start GOPs every gop_size frames. */
+    av_opt_set_int(enc, "sc_threshold", 1000000000, AV_OPT_SEARCH_CHILDREN);
+
+    if (avcodec_open2(enc, codec, NULL) < 0) {
+        err = "Cannot open encoder.";
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt  = av_packet_alloc();
+    bool ret       = frame && pkt;
+
+    if (ret) {
+        frame->format = enc->pix_fmt;
+        frame->width  = enc->width;
+        frame->height = enc->height;
+        ret = av_frame_get_buffer(frame, 0) >= 0;
+    }
+
+    for (int n = 0; ret && n <= c->frames; n++) {
+        if (n < c->frames) {
+            ret = av_frame_make_writable(frame) >= 0;
+            if (!ret)
+                break;
+
+            genfill(frame, n);
+            frame->pts     = n;
+            frame->quality = enc->global_quality;
+        }
+
+        if (avcodec_send_frame(enc, n < c->frames ? frame : NULL) < 0) {
+            ret = false;
+            break;
+        }
+
+        while (avcodec_receive_packet(enc, pkt) >= 0) {
+            if (av_packet_make_writable(pkt) < 0) {
+                ret = false;
+                break;
+            }
+
+            genpatch(pkt, c, pkt->pts);
+            packets.push_back(av_packet_clone(pkt));
+            av_packet_unref(pkt);
+        }
+    }
+
+    if (!ret)
+        err = "Encoding failed.";
+
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+
+    return ret;
+}
+
+static bool genmux(const gencase *c, AVCodecContext *enc, std::vector<AVPacket *>& packets,
+                   std::vector<uint8_t>& out, std::string& err)
+{
+    const char *muxer;
+
+    if (c->stream_type == ELEMENTARY)
+        muxer = c->mpeg_type == 1 ? "mpeg1video" : "mpeg2video";
+    else if (c->stream_type == PROGRAM)
+        muxer = c->mpeg_type == 1 ? "mpeg" : "vob";
+    else
+        muxer = "mpegts";
+
+    AVFormatContext *ofctx = NULL;
+    if (avformat_alloc_output_context2(&ofctx, NULL, muxer, NULL) < 0) {
+        err  = "Cannot allocate muxer: ";
+        err += muxer;
+        return false;
+    }
+
+    AVStream *st = avformat_new_stream(ofctx, NULL);
+    bool ret     = st && avcodec_parameters_from_context(st->codecpar, enc) >= 0 && avio_open_dyn_buf(&ofctx->pb) >= 0;
+
+    if (ret) {
+        st->time_base = enc->time_base;
+        if (c->stream_type == TRANSPORT)
+            st->id = GEN_TS_PID;
+
+        ret = avformat_write_header(ofctx, NULL) >= 0;
+    }
+
+    for (size_t i = 0; ret && i < packets.size(); i++) {
+        AVPacket *pkt = av_packet_clone(packets[i]);
+
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+
+        ret = av_interleaved_write_frame(ofctx, pkt) >= 0;
+        av_packet_free(&pkt);
+    }
+
+    if (ret)
+        ret = av_write_trailer(ofctx) >= 0;
+
+    if (ofctx->pb) {
+        uint8_t *buf = NULL;
+        int size     = avio_close_dyn_buf(ofctx->pb, &buf);
+
+        out.assign(buf, buf + size);
+        av_free(buf);
+        ofctx->pb = NULL;
+    }
+
+    avformat_free_context(ofctx);
+
+    if (!ret)
+        err = "Muxing failed.";
+
+    return ret;
+}
+
+/*
+ * Get the video elementary stream back out of the muxed stream, without
+ * any parsing, so every chunk of it can be mapped to the position of the
+ * PES packet it came from, which is where DGIndex points GOPs to.
+ */
+static bool gendemux(const gencase *c, const std::vector<uint8_t>& muxed, std::vector<uint8_t>& es,
+                     std::vector<genchunk>& chunks, std::string& err)
+{
+    if (c->stream_type == ELEMENTARY) {
+        es = muxed;
+        return true;
+    }
+
+    genmemory m = { &muxed, 0 };
+
+    uint8_t *buf = (uint8_t *) av_malloc(32 * 1024);
+    if (!buf) {
+        err = "Cannot allocate AVIO buffer.";
+        return false;
+    }
+
+    AVFormatContext *ifctx = avformat_alloc_context();
+    if (!ifctx) {
+        av_free(buf);
+        err = "Cannot allocate AVFormatContext.";
+        return false;
+    }
+
+    ifctx->pb     = avio_alloc_context(buf, 32 * 1024, 0, &m, genread, NULL, genseek);
+    ifctx->flags |= AVFMT_FLAG_CUSTOM_IO | AVFMT_FLAG_NOPARSE;
+
+    AVIOContext *pb = ifctx->pb;
+    const AVInputFormat *demuxer = av_find_input_format(c->stream_type == PROGRAM ? "mpeg" : "mpegts");
+
+    if (avformat_open_input(&ifctx, NULL, demuxer, NULL) < 0) {
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        err = "Cannot open the muxed stream.";
+        return false;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+
+    while (pkt && av_read_frame(ifctx, pkt) >= 0) {
+        AVStream *st = ifctx->streams[pkt->stream_index];
+        bool video   = st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+                       (c->stream_type != TRANSPORT || st->id == GEN_TS_PID);
+
+        if (video && pkt->size > 0) {
+            chunks.push_back({ (int64_t) es.size(), pkt->pos });
+            es.insert(es.end(), pkt->data, pkt->data + pkt->size);
+        }
+
+        av_packet_unref(pkt);
+    }
+
+    av_packet_free(&pkt);
+    avformat_close_input(&ifctx);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+
+    if (es.empty()) {
+        err = "No video found in the muxed stream.";
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Position in the muxed stream of the PES packet holding the given byte
+ * of the elementary stream, or the byte itself if there is no container.
+ */
+static int64_t genposition(const std::vector<genchunk>& chunks, int64_t es_pos)
+{
+    if (chunks.empty())
+        return es_pos;
+
+    auto it = std::upper_bound(chunks.begin(), chunks.end(), es_pos,
+                               [](int64_t pos, const genchunk& ch) { return pos < ch.es_pos; });
+
+    if (it == chunks.begin())
+        return -1;
+
+    return (it - 1)->pos;
+}
+
+/*
+ * Find the GOPs and pictures of an elementary stream from its start codes.
+ * Pictures are in coded order, the same as the encoder's packets, which
+ * give their display order.
+ */
+static void genindex(const std::vector<uint8_t>& es, const std::vector<int64_t>& display, std::vector<gengop>& gops)
+{
+    const uint8_t *data  = es.data();
+    int64_t size         = (int64_t) es.size();
+    int64_t seq_pos      = -1;
+    bool progressive_seq = true;
+    size_t pictures      = 0;
+
+    for (int64_t i = 0; i + 8 < size; i++) {
+        if (data[i] || data[i + 1] || data[i + 2] != 1)
+            continue;
+
+        const uint8_t *b = data + i + 4;
+
+        switch (data[i + 3]) {
+        case 0xB3:
+            seq_pos = i;
+            break;
+        case 0xB5:
+            if ((b[0] >> 4) == 1) {
+                progressive_seq = !!(b[1] & 0x08);
+            } else if ((b[0] >> 4) == 8 && !gops.empty() && !gops.back().pictures.empty()) {
+                genpicture& p = gops.back().pictures.back();
+
+                p.tff         = !!(b[3] & 0x80);
+                p.rff         = !!(b[3] & 0x02);
+                p.progressive = !!(b[4] & 0x80);
+            }
+            break;
+        case 0xB8: {
+            gengop g;
+
+            /* The sequence header goes with the GOP, if nothing came in between. */
+            g.es_pos               = seq_pos >= 0 ? seq_pos : i;
+            g.closed               = !!(b[3] & 0x40);
+            g.progressive_sequence = progressive_seq;
+            gops.push_back(g);
+            break;
+        }
+        case 0x00:
+            if (!gops.empty() && pictures < display.size()) {
+                genpicture p;
+
+                /* MPEG-1 pictures have no extension, and are always progressive. */
+                p.display     = display[pictures];
+                p.type        = (b[1] >> 3) & 7;
+                p.tff         = false;
+                p.rff         = false;
+                p.progressive = true;
+                gops.back().pictures.push_back(p);
+            }
+            pictures++;
+            seq_pos = -1;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* Build a GOP line's frame flags, in display order, the way DGIndex does. */
+static std::vector<uint8_t> genflags(const gengop& g)
+{
+    std::vector<genpicture> display = g.pictures;
+    std::sort(display.begin(), display.end(),
+              [](const genpicture& a, const genpicture& b) { return a.display < b.display; });
+
+    /* In an open GOP, B pictures shown before the I picture need the previous GOP. */
+    int64_t intra_display = 0;
+    for (const genpicture& p : g.pictures) {
+        if (p.type == 1) {
+            intra_display = p.display;
+            break;
+        }
+    }
+
+    std::vector<uint8_t> flags;
+
+    for (const genpicture& p : display) {
+        uint8_t f = (uint8_t) (p.type << 4);
+
+        if (g.closed || p.type != 3 || p.display > intra_display)
+            f |= FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP;
+        if (p.progressive)
+            f |= FRAME_FLAG_PROGRESSIVE;
+        if (p.tff)
+            f |= FRAME_FLAG_TFF;
+        if (p.rff)
+            f |= FRAME_FLAG_RFF;
+
+        flags.push_back(f);
+    }
+
+    return flags;
+}
+
+static bool genwrite(const fs::path& path, const uint8_t *data, size_t size, std::string& err)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> out(genopen(path, "wb"), &fclose);
+
+    if (!out || fwrite(data, 1, size, out.get()) != size) {
+        err = "Cannot write " + path.u8string();
+        return false;
+    }
+
+    return true;
+}
+
+static bool gencase_run(const gencase *c, const fs::path& dir, std::string& err)
+{
+    std::vector<AVPacket *> packets;
+    std::vector<uint8_t> muxed;
+    std::vector<uint8_t> es;
+    std::vector<genchunk> chunks;
+    std::vector<gengop> gops;
+    std::vector<int64_t> display;
+    AVCodecContext *enc = NULL;
+
+    bool ret = genencode(c, &enc, packets, err) && genmux(c, enc, packets, muxed, err) &&
+               gendemux(c, muxed, es, chunks, err);
+
+    for (AVPacket *pkt : packets) {
+        display.push_back(pkt->pts);
+        av_packet_free(&pkt);
+    }
+    avcodec_free_context(&enc);
+
+    if (!ret)
+        return false;
+
+    genindex(es, display, gops);
+
+    size_t pictures = 0;
+    for (const gengop& g : gops)
+        pictures += g.pictures.size();
+
+    if (pictures != (size_t) c->frames) {
+        err = "Indexed " + std::to_string(pictures) + " pictures, but encoded " + std::to_string(c->frames) + ".";
+        return false;
+    }
+
+    /* Split the stream at arbitrary points, which needn't be packet boundaries. */
+    const char *ext = c->stream_type == ELEMENTARY ? (c->mpeg_type == 1 ? "m1v" : "m2v") :
+                      c->stream_type == PROGRAM ? "mpg" : "ts";
+
+    std::vector<int64_t> starts;
+    std::vector<fs::path> names;
+
+    for (int i = 0; i < c->files; i++) {
+        int64_t start = (int64_t) muxed.size() * i / c->files;
+        int64_t end   = (int64_t) muxed.size() * (i + 1) / c->files;
+
+        std::string name = c->name;
+        if (c->files > 1)
+            name += "." + std::to_string(i);
+        name += ".";
+        name += ext;
+
+        fs::path path = fs::absolute(dir / name);
+        if (!genwrite(path, muxed.data() + start, (size_t) (end - start), err))
+            return false;
+
+        starts.push_back(start);
+        names.push_back(path);
+    }
+
+    std::string d2v = "DGIndexProjectFile" D2V_VERSION "\n";
+
+    d2v += std::to_string(c->files) + "\n";
+    for (const fs::path& name : names)
+        d2v += name.u8string() + "\n";
+
+    char line[256];
+
+    d2v += "\nStream_Type=" + std::to_string((int) c->stream_type) + "\n";
+    if (c->stream_type == TRANSPORT) {
+        snprintf(line, sizeof(line), "MPEG2_Transport_PID=%x,0,0\n", GEN_TS_PID);
+        d2v += line;
+    }
+    d2v += "MPEG_Type=" + std::to_string(c->mpeg_type) + "\n";
+    d2v += "iDCT_Algorithm=5\nYUVRGB_Scale=1\nLuminance_Filter=0,0\nClipping=0,0,0,0\nAspect_Ratio=4:3\n";
+    d2v += "Picture_Size=" + std::to_string(c->width) + "x" + std::to_string(c->height) + "\n";
+    d2v += "Field_Operation=0\nFrame_Rate=29970 (30000/1001)\n";
+
+    snprintf(line, sizeof(line), "Location=0,0,%d,%llx\n\n", c->files - 1,
+             (unsigned long long) (muxed.size() - starts.back()));
+    d2v += line;
+
+    for (size_t i = 0; i < gops.size(); i++) {
+        const gengop& g = gops[i];
+        int64_t pos     = genposition(chunks, g.es_pos);
+
+        if (pos < 0) {
+            err = "GOP " + std::to_string(i) + " has no position in the muxed stream.";
+            return false;
+        }
+
+        int file = (int) (std::upper_bound(starts.begin(), starts.end(), pos) - starts.begin()) - 1;
+
+        uint16_t info = GOP_FLAG_I_PICTURE_STARTS_NEW_GOP;
+        if (g.progressive_sequence)
+            info |= GOP_FLAG_PROGRESSIVE_SEQUENCE;
+        if (g.closed)
+            info |= GOP_FLAG_CLOSED;
+
+        snprintf(line, sizeof(line), "%x %d %d %lld 0 0 0", info, c->mpeg_type == 2 ? 6 : 5, file,
+                 (long long) (pos - starts[file]));
+        d2v += line;
+
+        for (uint8_t f : genflags(g)) {
+            snprintf(line, sizeof(line), " %x", f);
+            d2v += line;
+        }
+
+        if (i == gops.size() - 1)
+            d2v += " ff";
+        d2v += "\n";
+    }
+
+    d2v += "\nFINISHED  100.00% VIDEO\n";
+
+    return genwrite(dir / (std::string(c->name) + ".d2v"), (const uint8_t *) d2v.data(), d2v.size(), err);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: d2vgen <case|all> <output directory>\n"
+        "\n"
+        "Cases:\n");
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        fprintf(stderr, "    %s\n", cases[i].name);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        usage();
+        return 1;
+    }
+
+    bool all  = !strcmp(argv[1], "all");
+    bool done = false;
+    fs::path dir = fs::u8path(argv[2]);
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!all && strcmp(argv[1], cases[i].name))
+            continue;
+
+        std::string err;
+        if (!gencase_run(&cases[i], dir, err)) {
+            fprintf(stderr, "%s: %s\n", cases[i].name, err.c_str());
+            return 1;
+        }
+
+        done = true;
+    }
+
+    if (!done) {
+        usage();
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,620 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Benchmark and allocation check for the VapourSynth output path.
+ *
+ * Source is created and its frames requested through a minimal host,
+ * which implements only the parts of the VapourSynth API the plugin
+ * uses to create a source and output its frames. It is not a real core:
+ * there is no frame cache or threading, and every frame is requested
+ * once, in order, by calling the filter directly.
+ *
+ * Allocations made through C++ operator new inside host API calls are
+ * not counted, so what is left over is made by the plugin's own code:
+ * d2vGetVSFrame, d2vSetMotionVectors, d2vSetQP, and VSGetBuffer on the
+ * decoder threads. Frames the plugin creates through the API are counted
+ * separately, since a real core allocates for each of them: the output
+ * frames, and a direct-rendered buffer per decoded picture. FFmpeg's own
+ * allocations are not counted, which leaves out the AVBufferRef that
+ * VSGetBuffer creates with every one of those buffers.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+#include <VapourSynth4.h>
+
+#include "d2vsource4.hpp"
+
+typedef std::chrono::steady_clock benchclock;
+
+static std::atomic<int64_t> allocations(0);
+
+/* Frames created through the host API by the plugin. */
+static std::atomic<int64_t> frames_created(0);
+
+/* Nesting of host API calls on this thread. */
+static thread_local int host_depth = 0;
+
+void *operator new(size_t size)
+{
+    if (!host_depth)
+        allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void *ret = malloc(size ? size : 1);
+    if (!ret)
+        throw std::bad_alloc();
+
+    return ret;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+/* Keeps allocations made by the host out of the count, while in scope. */
+class hostscope {
+public:
+    hostscope() { host_depth++; }
+    ~hostscope() { host_depth--; }
+};
+
+/* Count a frame created by the plugin, rather than by the host itself. */
+static void host_count_frame(void)
+{
+    if (!host_depth)
+        frames_created.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct VSCore {
+    int unused;
+};
+
+typedef struct hostvalue {
+    std::string key;
+    int type;
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    std::vector<std::string> data;
+    VSNode *node;
+} hostvalue;
+
+struct VSMap {
+    std::vector<hostvalue> values;
+    std::string error;
+};
+
+struct VSFrame {
+    VSVideoFormat format;
+    int width;
+    int height;
+    std::shared_ptr<uint8_t> planes[3];
+    ptrdiff_t stride[3];
+    VSMap props;
+};
+
+struct VSNode {
+    VSVideoInfo vi;
+    VSFilterGetFrame get_frame;
+    VSFilterFree free;
+    void *instance;
+    int refs;
+};
+
+struct VSFrameContext {
+    std::string error;
+};
+
+static const VSAPI *host_api(void);
+
+static const hostvalue *host_find(const VSMap *map, const char *key)
+{
+    for (const hostvalue& v : map->values)
+        if (v.key == key)
+            return &v;
+
+    return NULL;
+}
+
+/* Find the value of key to set, replacing it unless appending. */
+static hostvalue *host_set(VSMap *map, const char *key, int type, int append)
+{
+    hostvalue *v = const_cast<hostvalue *>(host_find(map, key));
+
+    if (!v) {
+        map->values.emplace_back();
+        v      = &map->values.back();
+        v->key = key;
+    }
+
+    if (v->type != type || append == maReplace) {
+        v->ints.clear();
+        v->floats.clear();
+        v->data.clear();
+        v->node = NULL;
+    }
+
+    v->type = type;
+
+    return v;
+}
+
+static void VS_CC host_map_set_error(VSMap *map, const char *error)
+{
+    hostscope scope;
+    map->error = error;
+}
+
+static int VS_CC host_map_num_elements(const VSMap *map, const char *key)
+{
+    hostscope scope;
+    const hostvalue *v = host_find(map, key);
+
+    if (!v)
+        return -1;
+
+    return (int) (v->type == ptInt ? v->ints.size() : v->type == ptFloat ? v->floats.size() : v->data.size());
+}
+
+static int64_t VS_CC host_map_get_int(const VSMap *map, const char *key, int index, int *error)
+{
+    hostscope scope;
+    const hostvalue *v = host_find(map, key);
+
+    bool unset = !v || v->type != ptInt || index < 0 || index >= (int) v->ints.size();
+
+    if (error)
+        *error = unset;
+
+    return unset ? 0 : v->ints[index];
+}
+
+static int VS_CC host_map_get_int_saturated(const VSMap *map, const char *key, int index, int *error)
+{
+    return (int) std::clamp<int64_t>(host_map_get_int(map, key, index, error), INT_MIN, INT_MAX);
+}
+
+static const char *VS_CC host_map_get_data(const VSMap *map, const char *key, int index, int *error)
+{
+    hostscope scope;
+    const hostvalue *v = host_find(map, key);
+
+    bool unset = !v || v->type != ptData || index < 0 || index >= (int) v->data.size();
+
+    if (error)
+        *error = unset;
+
+    return unset ? NULL : v->data[index].c_str();
+}
+
+static int VS_CC host_map_set_int(VSMap *map, const char *key, int64_t i, int append)
+{
+    hostscope scope;
+    host_set(map, key, ptInt, append)->ints.push_back(i);
+    return 0;
+}
+
+static int VS_CC host_map_set_float(VSMap *map, const char *key, double d, int append)
+{
+    hostscope scope;
+    host_set(map, key, ptFloat, append)->floats.push_back(d);
+    return 0;
+}
+
+static int VS_CC host_map_set_data(VSMap *map, const char *key, const char *data, int size, int type, int append)
+{
+    hostscope scope;
+    host_set(map, key, ptData, append)->data.emplace_back(data, size < 0 ? strlen(data) : (size_t) size);
+    return 0;
+}
+
+static int VS_CC host_map_consume_node(VSMap *map, const char *key, VSNode *node, int append)
+{
+    hostscope scope;
+    host_set(map, key, ptVideoNode, maReplace)->node = node;
+    return 0;
+}
+
+static int VS_CC host_get_video_format_by_id(VSVideoFormat *format, uint32_t id, VSCore *core)
+{
+    format->colorFamily    = (id >> 28) & 0xF;
+    format->sampleType     = (id >> 24) & 0xF;
+    format->bitsPerSample  = (id >> 16) & 0xFF;
+    format->bytesPerSample = (format->bitsPerSample + 7) / 8;
+    format->subSamplingW   = (id >> 8) & 0xFF;
+    format->subSamplingH   = id & 0xFF;
+    format->numPlanes      = format->colorFamily == cfGray ? 1 : 3;
+
+    return 1;
+}
+
+static int VS_CC host_query_video_format(VSVideoFormat *format, int colorFamily, int sampleType, int bitsPerSample,
+                                         int subSamplingW, int subSamplingH, VSCore *core)
+{
+    format->colorFamily    = colorFamily;
+    format->sampleType     = sampleType;
+    format->bitsPerSample  = bitsPerSample;
+    format->bytesPerSample = (bitsPerSample + 7) / 8;
+    format->subSamplingW   = subSamplingW;
+    format->subSamplingH   = subSamplingH;
+    format->numPlanes      = colorFamily == cfGray ? 1 : 3;
+
+    return 1;
+}
+
+static int VS_CC host_get_frame_width(const VSFrame *f, int plane)
+{
+    return plane ? f->width >> f->format.subSamplingW : f->width;
+}
+
+static int VS_CC host_get_frame_height(const VSFrame *f, int plane)
+{
+    return plane ? f->height >> f->format.subSamplingH : f->height;
+}
+
+static VSFrame *VS_CC host_new_video_frame(const VSVideoFormat *format, int width, int height, const VSFrame *propSrc,
+                                           VSCore *core)
+{
+    host_count_frame();
+    hostscope scope;
+    VSFrame *f = new VSFrame();
+
+    f->format = *format;
+    f->width  = width;
+    f->height = height;
+
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        int row_size = host_get_frame_width(f, plane) * format->bytesPerSample;
+
+        f->stride[plane] = (row_size + 63) & ~63;
+        f->planes[plane].reset((uint8_t *) av_malloc(f->stride[plane] * host_get_frame_height(f, plane)), av_free);
+    }
+
+    if (propSrc)
+        f->props = propSrc->props;
+
+    return f;
+}
+
+static VSFrame *VS_CC host_new_video_frame2(const VSVideoFormat *format, int width, int height, const VSFrame **planeSrc,
+                                            const int *planes, const VSFrame *propSrc, VSCore *core)
+{
+    host_count_frame();
+    hostscope scope;
+    VSFrame *f = new VSFrame();
+
+    f->format = *format;
+    f->width  = width;
+    f->height = height;
+
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        f->planes[plane] = planeSrc[plane]->planes[planes[plane]];
+        f->stride[plane] = planeSrc[plane]->stride[planes[plane]];
+    }
+
+    if (propSrc)
+        f->props = propSrc->props;
+
+    return f;
+}
+
+static VSFrame *VS_CC host_copy_frame(const VSFrame *f, VSCore *core)
+{
+    host_count_frame();
+    hostscope scope;
+    return new VSFrame(*f);
+}
+
+static void VS_CC host_free_frame(const VSFrame *f)
+{
+    hostscope scope;
+    delete f;
+}
+
+static ptrdiff_t VS_CC host_get_stride(const VSFrame *f, int plane)
+{
+    return f->stride[plane];
+}
+
+static const uint8_t *VS_CC host_get_read_ptr(const VSFrame *f, int plane)
+{
+    return f->planes[plane].get();
+}
+
+static uint8_t *VS_CC host_get_write_ptr(VSFrame *f, int plane)
+{
+    return f->planes[plane].get();
+}
+
+static VSMap *VS_CC host_get_frame_properties_rw(VSFrame *f)
+{
+    return &f->props;
+}
+
+static VSNode *VS_CC host_create_video_filter2(const char *name, const VSVideoInfo *vi, VSFilterGetFrame getFrame,
+                                               VSFilterFree free, int filterMode, const VSFilterDependency *dependencies,
+                                               int numDeps, void *instanceData, VSCore *core)
+{
+    hostscope scope;
+    VSNode *node = new VSNode();
+
+    node->vi        = *vi;
+    node->get_frame = getFrame;
+    node->free      = free;
+    node->instance  = instanceData;
+    node->refs      = 1;
+
+    return node;
+}
+
+/* There is no cache for a linear filter to decode ahead into. */
+static int VS_CC host_set_linear_filter(VSNode *node)
+{
+    return 0;
+}
+
+static void VS_CC host_set_cache_options(VSNode *node, int fixedSize, int maxSize, int maxHistorySize)
+{
+}
+
+static VSNode *VS_CC host_add_node_ref(VSNode *node)
+{
+    node->refs++;
+    return node;
+}
+
+static void VS_CC host_free_node(VSNode *node)
+{
+    if (!node || --node->refs)
+        return;
+
+    hostscope scope;
+    VSCore core;
+
+    node->free(node->instance, &core, host_api());
+    delete node;
+}
+
+static const VSVideoInfo *VS_CC host_get_video_info(VSNode *node)
+{
+    return &node->vi;
+}
+
+static void VS_CC host_cache_frame(const VSFrame *frame, int n, VSFrameContext *frameCtx)
+{
+}
+
+static void VS_CC host_set_filter_error(const char *errorMessage, VSFrameContext *frameCtx)
+{
+    hostscope scope;
+    frameCtx->error = errorMessage;
+}
+
+static const VSAPI *host_api(void)
+{
+    static VSAPI api = [] {
+        VSAPI a = {};
+
+        a.createVideoFilter2    = host_create_video_filter2;
+        a.setLinearFilter       = host_set_linear_filter;
+        a.setCacheOptions       = host_set_cache_options;
+        a.addNodeRef            = host_add_node_ref;
+        a.freeNode              = host_free_node;
+        a.getVideoInfo          = host_get_video_info;
+        a.newVideoFrame         = host_new_video_frame;
+        a.newVideoFrame2        = host_new_video_frame2;
+        a.copyFrame             = host_copy_frame;
+        a.freeFrame             = host_free_frame;
+        a.getStride             = host_get_stride;
+        a.getReadPtr            = host_get_read_ptr;
+        a.getWritePtr           = host_get_write_ptr;
+        a.getFrameWidth         = host_get_frame_width;
+        a.getFrameHeight        = host_get_frame_height;
+        a.getFramePropertiesRW  = host_get_frame_properties_rw;
+        a.getVideoFormatByID    = host_get_video_format_by_id;
+        a.queryVideoFormat      = host_query_video_format;
+        a.cacheFrame            = host_cache_frame;
+        a.setFilterError        = host_set_filter_error;
+        a.mapSetError           = host_map_set_error;
+        a.mapNumElements        = host_map_num_elements;
+        a.mapGetInt             = host_map_get_int;
+        a.mapGetIntSaturated    = host_map_get_int_saturated;
+        a.mapSetInt             = host_map_set_int;
+        a.mapSetFloat           = host_map_set_float;
+        a.mapGetData            = host_map_get_data;
+        a.mapSetData            = host_map_set_data;
+        a.mapConsumeNode        = host_map_consume_node;
+
+        return a;
+    }();
+
+    return &api;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: d2vvsbench [options] input.d2v\n"
+        "\n"
+        "Options:\n"
+        "    --count <n>     Number of frames to request. Default is all of them.\n"
+        "    --threads <n>   Number of threads FFmpeg should use. Default is 0 (auto).\n"
+        "    --mvs           Export motion vectors.\n"
+        "    --qp            Export quantizers.\n"
+        "    --gray          Only output the luma plane.\n"
+        "    --nocrop        Output the frames uncropped.\n");
+}
+
+static double elapsed(benchclock::time_point start)
+{
+    return std::chrono::duration<double>(benchclock::now() - start).count();
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+
+    std::sort(values.begin(), values.end());
+
+    size_t idx = (size_t) (p * (double) (values.size() - 1) + 0.5);
+
+    return values[idx];
+}
+
+int main(int argc, char **argv)
+{
+    const char *input = NULL;
+    int count         = INT_MAX;
+    int threads       = 0;
+    bool mvs          = false;
+    bool qp           = false;
+    bool gray         = false;
+    bool nocrop       = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_arg = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--count") && has_arg) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && has_arg) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--mvs")) {
+            mvs = true;
+        } else if (!strcmp(argv[i], "--qp")) {
+            qp = true;
+        } else if (!strcmp(argv[i], "--gray")) {
+            gray = true;
+        } else if (!strcmp(argv[i], "--nocrop")) {
+            nocrop = true;
+        } else if (argv[i][0] != '-' && !input) {
+            input = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!input || count <= 0 || threads < 0) {
+        usage();
+        return 1;
+    }
+
+    const VSAPI *vsapi = host_api();
+    VSCore core;
+    VSMap in;
+    VSMap out;
+
+    /* Only the source itself, without ApplyRFF or a shared node around it. */
+    vsapi->mapSetData(&in, "input", input, -1, dtUtf8, maReplace);
+    vsapi->mapSetInt(&in, "threads", threads, maReplace);
+    vsapi->mapSetInt(&in, "rff", 0, maReplace);
+    vsapi->mapSetInt(&in, "share", 0, maReplace);
+    vsapi->mapSetInt(&in, "mvs", mvs, maReplace);
+    vsapi->mapSetInt(&in, "qp", qp, maReplace);
+    vsapi->mapSetInt(&in, "gray", gray, maReplace);
+    vsapi->mapSetInt(&in, "nocrop", nocrop, maReplace);
+
+    vs4::d2vCreate(&in, &out, NULL, &core, vsapi);
+
+    if (!out.error.empty()) {
+        fprintf(stderr, "%s\n", out.error.c_str());
+        return 1;
+    }
+
+    VSNode *node = host_find(&out, "clip")->node;
+    int frames   = std::min(count, node->vi.numFrames);
+
+    std::vector<double> latencies;
+    latencies.reserve(frames);
+
+    /* The first half of the frames warms up the decoder and the plugin's buffers. */
+    int steady_start      = frames / 2;
+    int64_t steady_allocs = 0;
+    int64_t steady_frames = 0;
+
+    for (int n = 0; n < frames; n++) {
+        VSFrameContext ctx;
+        void *frame_data = NULL;
+
+        benchclock::time_point frame_start = benchclock::now();
+        int64_t allocs_before = allocations.load(std::memory_order_relaxed);
+        int64_t frames_before = frames_created.load(std::memory_order_relaxed);
+
+        const VSFrame *f = node->get_frame(n, arInitial, node->instance, &frame_data, &ctx, &core, vsapi);
+        vsapi->freeFrame(f);
+
+        if (n >= steady_start) {
+            steady_allocs += allocations.load(std::memory_order_relaxed) - allocs_before;
+            steady_frames += frames_created.load(std::memory_order_relaxed) - frames_before;
+        }
+
+        latencies.push_back(elapsed(frame_start) * 1000.0);
+
+        if (!f) {
+            fprintf(stderr, "Frame %d: %s\n", n, ctx.error.c_str());
+            vsapi->freeNode(node);
+            return 1;
+        }
+    }
+
+    vsapi->freeNode(node);
+
+    double total = 0.0;
+    for (size_t i = 0; i < latencies.size(); i++)
+        total += latencies[i] / 1000.0;
+
+    printf("{\"frames\": %d, \"time\": %.6f, \"fps\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+           "\"steady_allocs\": %lld, \"steady_frames\": %lld}\n",
+           frames, total, total > 0.0 ? (double) frames / total : 0.0,
+           percentile(latencies, 0.5), percentile(latencies, 0.99), (long long) steady_allocs, (long long) steady_frames);
+
+    /* Frames are allocated by the core, and can't be avoided, so only the plugin's own allocations fail. */
+    if (steady_allocs) {
+        fprintf(stderr, "%lld allocations after warm-up, expected none.\n", (long long) steady_allocs);
+        return 4;
+    }
+
+    return 0;
+}
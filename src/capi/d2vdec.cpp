@@ -0,0 +1,418 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <memory>
+#include <string>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "d2v.hpp"
+#include "d2vdec.h"
+#include "decode.hpp"
+#include "gop.hpp"
+
+struct d2vdec {
+    std::unique_ptr<d2vcontext> d2v;
+    std::unique_ptr<decodecontext> dec;
+    AVFrame *frame;
+
+    d2vdec_format format;
+    bool format_set;
+    int aligned_width;
+    int aligned_height;
+
+    d2vdec_alloc_func alloc;
+    d2vdec_free_func free;
+    void *opaque;
+
+    std::string err;
+    std::string alloc_err; // Why the allocator's last buffer was rejected.
+
+    ~d2vdec();
+};
+
+/* What we need to give a buffer back, which may happen after d2vdec_close(). */
+typedef struct d2vdecbuffer {
+    d2vdec_free_func free;
+    void *opaque;
+    void *buffer_opaque;
+} d2vdecbuffer;
+
+static const struct {
+    enum AVPixelFormat pix_fmt;
+    d2vdec_format format;
+    int subsampling_w;
+    int subsampling_h;
+    int bytes_per_sample;
+} format_conv[] = {
+    { AV_PIX_FMT_YUV420P,   D2VDEC_FORMAT_YUV420P8,  1, 1, 1 },
+    { AV_PIX_FMT_YUVJ420P,  D2VDEC_FORMAT_YUV420P8,  1, 1, 1 },
+    { AV_PIX_FMT_YUV422P,   D2VDEC_FORMAT_YUV422P8,  1, 0, 1 },
+    { AV_PIX_FMT_YUVJ422P,  D2VDEC_FORMAT_YUV422P8,  1, 0, 1 },
+    { AV_PIX_FMT_YUV444P,   D2VDEC_FORMAT_YUV444P8,  0, 0, 1 },
+    { AV_PIX_FMT_YUVJ444P,  D2VDEC_FORMAT_YUV444P8,  0, 0, 1 },
+    { AV_PIX_FMT_YUV420P9,  D2VDEC_FORMAT_YUV420P9,  1, 1, 2 },
+    { AV_PIX_FMT_YUV422P9,  D2VDEC_FORMAT_YUV422P9,  1, 0, 2 },
+    { AV_PIX_FMT_YUV444P9,  D2VDEC_FORMAT_YUV444P9,  0, 0, 2 },
+    { AV_PIX_FMT_YUV420P10, D2VDEC_FORMAT_YUV420P10, 1, 1, 2 },
+    { AV_PIX_FMT_YUV422P10, D2VDEC_FORMAT_YUV422P10, 1, 0, 2 },
+    { AV_PIX_FMT_YUV444P10, D2VDEC_FORMAT_YUV444P10, 0, 0, 2 },
+};
+
+static int format_index(d2vdec_format format)
+{
+    for (size_t i = 0; i < sizeof(format_conv) / sizeof(format_conv[0]); i++)
+        if (format_conv[i].format == format)
+            return (int) i;
+
+    return -1;
+}
+
+d2vdec::~d2vdec()
+{
+    if (frame)
+        av_frame_free(&frame);
+}
+
+static void d2vdecReleaseBuffer(void *opaque, uint8_t *data)
+{
+    d2vdecbuffer *buf = (d2vdecbuffer *) opaque;
+
+    buf->free(buf->opaque, buf->buffer_opaque);
+    delete buf;
+}
+
+/*
+ * Custom get_buffer2, which picks up the output format, and
+ * direct-renders into the caller's buffers if it set an allocator.
+ */
+static int d2vdecGetBuffer(AVCodecContext *avctx, AVFrame *pic, int flags)
+{
+    d2vdec *d = (d2vdec *) avctx->opaque;
+
+    size_t i;
+
+    for (i = 0; i < sizeof(format_conv) / sizeof(format_conv[0]); i++)
+        if (format_conv[i].pix_fmt == avctx->pix_fmt)
+            break;
+
+    if (i == sizeof(format_conv) / sizeof(format_conv[0]))
+        return -1;
+
+    /* Every picture must be in the format the caller was given. */
+    if (!d->format_set) {
+        d->format     = format_conv[i].format;
+        d->format_set = true;
+    } else if (format_conv[i].format != d->format) {
+        return -1;
+    }
+
+    if (!d->alloc)
+        return avcodec_default_get_buffer2(avctx, pic, flags);
+
+    int idx = format_index(d->format);
+
+    d2vdec_buffer buf = {};
+    buf.size   = sizeof(buf);
+    buf.format = d->format;
+    for (int i = 0; i < 3; i++) {
+        int ssw = i ? format_conv[idx].subsampling_w : 0;
+        int ssh = i ? format_conv[idx].subsampling_h : 0;
+
+        buf.width[i]  = AV_CEIL_RSHIFT(d->aligned_width, ssw) * format_conv[idx].bytes_per_sample;
+        buf.height[i] = AV_CEIL_RSHIFT(d->aligned_height, ssh);
+    }
+
+    std::unique_ptr<d2vdecbuffer> userdata(new d2vdecbuffer());
+    userdata->free   = d->free;
+    userdata->opaque = d->opaque;
+
+    if (d->alloc(d->opaque, &buf, &userdata->buffer_opaque) < 0) {
+        d->alloc_err = "Allocator failed.";
+        return -1;
+    }
+
+    /* libavcodec writes with SIMD past the plane widths, up to the linesizes. */
+    for (int i = 0; i < 3; i++) {
+        if (!buf.data[i] || ((uintptr_t) buf.data[i] % 64) || (buf.linesize[i] % 64) || buf.linesize[i] < buf.width[i]) {
+            d->alloc_err = "Allocator returned a buffer which is too small or not aligned to 64 bytes.";
+            d->free(d->opaque, userdata->buffer_opaque);
+            return -1;
+        }
+    }
+
+    pic->buf[0] = av_buffer_create(NULL, 0, d2vdecReleaseBuffer, userdata.get(), 0);
+    if (!pic->buf[0]) {
+        d->free(d->opaque, userdata->buffer_opaque);
+        return -1;
+    }
+    userdata.release();
+
+    pic->extended_data       = pic->data;
+    pic->width               = d->aligned_width;
+    pic->height              = d->aligned_height;
+    pic->format              = avctx->pix_fmt;
+    pic->sample_aspect_ratio = avctx->sample_aspect_ratio;
+
+    for (int i = 0; i < 3; i++) {
+        pic->data[i]     = buf.data[i];
+        pic->linesize[i] = (int) buf.linesize[i];
+    }
+
+    return 0;
+}
+
+/*
+ * Structs the caller allocates may be from a later header, and so be
+ * larger, but never smaller. Later versions must keep accepting the
+ * sizes of earlier ones, and only fill in the fields that fit.
+ */
+#define D2VDEC_SIZE_OK(s) ((s)->size >= sizeof(*(s)))
+
+unsigned int d2vdec_version(void)
+{
+    return D2VDEC_VERSION;
+}
+
+d2vdec *d2vdec_open(const char *path, int threads, char *err, size_t err_size)
+{
+    std::string msg;
+    std::unique_ptr<d2vdec> d(new d2vdec());
+
+    d->d2v.reset(d2vparse(path, msg));
+    if (d->d2v)
+        d->dec.reset(decodeinit(d->d2v.get(), threads, msg));
+
+    if (d->dec) {
+        d->dec->avctx->opaque      = (void *) d.get();
+        d->dec->avctx->get_buffer2 = d2vdecGetBuffer;
+
+        d->aligned_width  = FFALIGN(d->d2v->width, 16);
+        d->aligned_height = FFALIGN(d->d2v->height, 32);
+
+        d->frame = av_frame_alloc();
+        if (!d->frame)
+            msg = "Cannot allocate AVFrame.";
+    }
+
+    /* Decode 1 frame to find out the output format. */
+    bool ok = false;
+
+    if (d->frame) {
+        if (decodeframe(0, d->d2v.get(), d->dec.get(), d->frame, msg) < 0)
+            msg.insert(0, "Failed to decode test frame: ");
+        else if (!d->format_set)
+            msg = "Video has unsupported pixel format.";
+        else if (!d->frame->buf[0])
+            msg = "Failed to decode test frame: the stream ended early.";
+        else
+            ok = true;
+
+        av_frame_unref(d->frame);
+    }
+
+    if (!ok) {
+        if (err && err_size)
+            snprintf(err, err_size, "%s", msg.c_str());
+        return NULL;
+    }
+
+    return d.release();
+}
+
+void d2vdec_close(d2vdec *d)
+{
+    delete d;
+}
+
+const char *d2vdec_get_error(const d2vdec *d)
+{
+    return d->err.c_str();
+}
+
+int d2vdec_get_info(const d2vdec *d, d2vdec_info *info)
+{
+    if (!D2VDEC_SIZE_OK(info))
+        return -1;
+
+    int idx = format_index(d->format);
+
+    info->num_frames       = (int) d->d2v->frames.size();
+    info->width            = d->d2v->width;
+    info->height           = d->d2v->height;
+    info->aligned_width    = d->aligned_width;
+    info->aligned_height   = d->aligned_height;
+    info->fps_num          = d->d2v->fps_num;
+    info->fps_den          = d->d2v->fps_den;
+    info->mpeg_type        = d->d2v->mpeg_type;
+    info->format           = d->format;
+    info->subsampling_w    = format_conv[idx].subsampling_w;
+    info->subsampling_h    = format_conv[idx].subsampling_h;
+    info->bytes_per_sample = format_conv[idx].bytes_per_sample;
+
+    return 0;
+}
+
+int d2vdec_get_frame_info(const d2vdec *d, int n, d2vdec_frame_info *info)
+{
+    if (!D2VDEC_SIZE_OK(info) || n < 0 || n >= (int) d->d2v->frames.size())
+        return -1;
+
+    const frame& f = d->d2v->frames[n];
+    const gop& g   = d->d2v->gops[f.gop];
+
+    info->gop      = f.gop;
+    info->offset   = f.offset;
+    info->flags    = g.flags[f.offset];
+    info->gop_info = g.info;
+    info->matrix   = g.matrix;
+    info->file     = g.file;
+    info->pos      = g.pos;
+
+    return 0;
+}
+
+int d2vdec_set_allocator(d2vdec *d, d2vdec_alloc_func alloc, d2vdec_free_func free, void *opaque)
+{
+    /* Buffers are always given back through free. */
+    if (alloc && !free) {
+        d->err = "An allocator needs a free callback.";
+        return -1;
+    }
+
+    d->alloc  = alloc;
+    d->free   = free;
+    d->opaque = opaque;
+
+    return 0;
+}
+
+/* Decode a frame into our own AVFrame, which is left referenced. */
+static int d2vdecDecodeFrame(d2vdec *d, int n)
+{
+    if (n < 0 || n >= (int) d->d2v->frames.size()) {
+        d->err = "Frame number out of range.";
+        return -1;
+    }
+
+    av_frame_unref(d->frame);
+    d->alloc_err.clear();
+
+    if (decodeframe(n, d->d2v.get(), d->dec.get(), d->frame, d->err) < 0) {
+        if (!d->alloc_err.empty())
+            d->err = d->alloc_err;
+        return -1;
+    }
+
+    /* The decoder ran out of packets before it got to this frame. */
+    if (!d->frame->buf[0]) {
+        d->err = "Frame could not be decoded; the stream may be truncated.";
+        return -1;
+    }
+
+    return 0;
+}
+
+int d2vdec_decode(d2vdec *d, int n, d2vdec_picture *pic)
+{
+    if (!D2VDEC_SIZE_OK(pic)) {
+        d->err = "Picture size is too small.";
+        return -1;
+    }
+
+    if (d2vdecDecodeFrame(d, n) < 0)
+        return -1;
+
+    AVFrame *ref = av_frame_alloc();
+    if (!ref) {
+        d->err = "Cannot allocate AVFrame.";
+        return -1;
+    }
+
+    /* Hand our reference over to the picture. */
+    av_frame_move_ref(ref, d->frame);
+
+    pic->format   = d->format;
+    pic->width    = d->d2v->width;
+    pic->height   = d->d2v->height;
+    pic->internal = ref;
+
+    for (int i = 0; i < 3; i++) {
+        pic->data[i]     = ref->data[i];
+        pic->linesize[i] = ref->linesize[i];
+    }
+
+    switch (ref->pict_type) {
+    case AV_PICTURE_TYPE_I:
+        pic->pict_type = 'I';
+        break;
+    case AV_PICTURE_TYPE_P:
+        pic->pict_type = 'P';
+        break;
+    case AV_PICTURE_TYPE_B:
+        pic->pict_type = 'B';
+        break;
+    default:
+        pic->pict_type = 0;
+        break;
+    }
+
+    return 0;
+}
+
+void d2vdec_picture_release(d2vdec_picture *pic)
+{
+    AVFrame *ref = (AVFrame *) pic->internal;
+
+    av_frame_free(&ref);
+    pic->internal = NULL;
+}
+
+int d2vdec_decode_to(d2vdec *d, int n, uint8_t *const data[3], const ptrdiff_t linesize[3])
+{
+    if (d2vdecDecodeFrame(d, n) < 0)
+        return -1;
+
+    int idx = format_index(d->format);
+
+    for (int i = 0; i < 3; i++) {
+        int ssw = i ? format_conv[idx].subsampling_w : 0;
+        int ssh = i ? format_conv[idx].subsampling_h : 0;
+
+        size_t width = (size_t) AV_CEIL_RSHIFT(d->d2v->width, ssw) * format_conv[idx].bytes_per_sample;
+        int height   = AV_CEIL_RSHIFT(d->d2v->height, ssh);
+
+        for (int y = 0; y < height; y++)
+            memcpy(data[i] + y * linesize[i], d->frame->data[i] + (ptrdiff_t) y * d->frame->linesize[i], width);
+    }
+
+    av_frame_unref(d->frame);
+
+    return 0;
+}
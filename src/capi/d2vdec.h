@@ -0,0 +1,183 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/*
+ * Headless C API to the D2V decoding core, for use without VapourSynth.
+ *
+ * A handle must only be used from one thread at a time. Pictures returned
+ * by d2vdec_decode() stay valid until released, even after the handle
+ * has been closed.
+ *
+ * Structs passed in for the library to fill start with their size, which
+ * must be set to sizeof the struct first. Fields are only ever added at
+ * the end, so a program keeps working with later versions of the library
+ * with the same major version.
+ */
+
+#ifndef D2VDEC_H
+#define D2VDEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The library is built with D2VDEC_BUILD defined. Users of a static
+ * build on Windows need to define D2VDEC_STATIC.
+ */
+#if defined(_WIN32) && defined(D2VDEC_STATIC)
+#define D2VDEC_API
+#elif defined(_WIN32) && defined(D2VDEC_BUILD)
+#define D2VDEC_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define D2VDEC_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#define D2VDEC_API __attribute__((visibility("default")))
+#else
+#define D2VDEC_API
+#endif
+
+/* The major version only changes when the ABI breaks, along with the soname. */
+#define D2VDEC_VERSION_MAJOR 1
+#define D2VDEC_VERSION_MINOR 0
+#define D2VDEC_VERSION_MICRO 0
+
+#define D2VDEC_VERSION ((D2VDEC_VERSION_MAJOR << 16) | (D2VDEC_VERSION_MINOR << 8) | D2VDEC_VERSION_MICRO)
+
+typedef struct d2vdec d2vdec;
+
+typedef enum d2vdec_format {
+    D2VDEC_FORMAT_YUV420P8  = 0,
+    D2VDEC_FORMAT_YUV422P8  = 1,
+    D2VDEC_FORMAT_YUV444P8  = 2,
+    D2VDEC_FORMAT_YUV420P9  = 3,
+    D2VDEC_FORMAT_YUV422P9  = 4,
+    D2VDEC_FORMAT_YUV444P9  = 5,
+    D2VDEC_FORMAT_YUV420P10 = 6,
+    D2VDEC_FORMAT_YUV422P10 = 7,
+    D2VDEC_FORMAT_YUV444P10 = 8
+} d2vdec_format;
+
+typedef struct d2vdec_info {
+    size_t size;          /* Set by the caller. */
+    int num_frames;
+    int width;            /* Visible dimensions. */
+    int height;
+    int aligned_width;    /* Dimensions of the buffers the decoder renders into. */
+    int aligned_height;
+    int fps_num;
+    int fps_den;
+    int mpeg_type;        /* 1, 2 or 264. */
+    d2vdec_format format;
+    int subsampling_w;    /* log2 of the chroma subsampling. */
+    int subsampling_h;
+    int bytes_per_sample;
+} d2vdec_info;
+
+typedef struct d2vdec_frame_info {
+    size_t size;          /* Set by the caller. */
+    int gop;
+    int offset;           /* Coded position within its GOP. */
+    uint8_t flags;        /* FRAME_FLAG_* bits from the D2V. */
+    uint16_t gop_info;    /* GOP_FLAG_* bits from the D2V. */
+    int matrix;
+    int file;
+    uint64_t pos;         /* Byte position of the GOP in its file. */
+} d2vdec_frame_info;
+
+/*
+ * A buffer request from the decoder, filled in by an allocator callback.
+ * Each plane must hold height[i] lines of width[i] bytes, and every
+ * pointer and linesize must be aligned to 64 bytes. Fields past size
+ * don't exist in the library making the request.
+ */
+typedef struct d2vdec_buffer {
+    size_t size;          /* Set by the library. */
+    d2vdec_format format;
+    int width[3];         /* In bytes. */
+    int height[3];
+    uint8_t *data[3];
+    ptrdiff_t linesize[3];
+} d2vdec_buffer;
+
+/*
+ * Called from the decoder to get a buffer to render into. Returns 0 on
+ * success, and may set *buffer_opaque to anything it needs to free it.
+ * The free callback is called once the decoder and all pictures are
+ * done with the buffer.
+ *
+ * With threads other than 1, libavcodec decodes on worker threads of its
+ * own, and the allocator is called from those, possibly several at once.
+ * The free callback may be called from any thread that releases a
+ * picture or decodes. Both must be thread-safe unless threads is 1.
+ */
+typedef int (*d2vdec_alloc_func)(void *opaque, d2vdec_buffer *buf, void **buffer_opaque);
+typedef void (*d2vdec_free_func)(void *opaque, void *buffer_opaque);
+
+typedef struct d2vdec_picture {
+    size_t size;          /* Set by the caller. */
+    d2vdec_format format;
+    int width;            /* Visible dimensions. */
+    int height;
+    const uint8_t *data[3];
+    ptrdiff_t linesize[3];
+    char pict_type;       /* 'I', 'P', 'B', or 0 if unknown. */
+    void *internal;
+} d2vdec_picture;
+
+/* Returns D2VDEC_VERSION of the library, which may differ from the header's. */
+D2VDEC_API unsigned int d2vdec_version(void);
+
+/* Returns NULL on failure, with a message written to err. */
+D2VDEC_API d2vdec *d2vdec_open(const char *path, int threads, char *err, size_t err_size);
+D2VDEC_API void d2vdec_close(d2vdec *d);
+
+D2VDEC_API const char *d2vdec_get_error(const d2vdec *d);
+
+/* These return -1 if info->size is too small. */
+D2VDEC_API int d2vdec_get_info(const d2vdec *d, d2vdec_info *info);
+D2VDEC_API int d2vdec_get_frame_info(const d2vdec *d, int n, d2vdec_frame_info *info);
+
+/*
+ * Have the decoder render straight into buffers from the given allocator.
+ * Passing NULL for alloc goes back to libavcodec's own buffers. Returns
+ * -1 if alloc is set without a free callback. Buffers which don't meet
+ * the size and alignment requirements fail the decode.
+ */
+D2VDEC_API int d2vdec_set_allocator(d2vdec *d, d2vdec_alloc_func alloc, d2vdec_free_func free, void *opaque);
+
+/* Decode frame n, and hand out a reference to the decoder's buffer. */
+D2VDEC_API int d2vdec_decode(d2vdec *d, int n, d2vdec_picture *pic);
+D2VDEC_API void d2vdec_picture_release(d2vdec_picture *pic);
+
+/* Decode frame n, and copy its visible area into the given planes. */
+D2VDEC_API int d2vdec_decode_to(d2vdec *d, int n, uint8_t *const data[3], const ptrdiff_t linesize[3]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,7 +25,11 @@
 
 #include "compat.hpp"
 
-void d2vgetline(FILE *f, std::string& str)
+/*
+ * Read a line, without its line ending. Returns false if the file
+ * ended before the line did.
+ */
+bool d2vgetline(FILE *f, std::string& str)
 {
     str.clear();
 
@@ -33,12 +37,12 @@ void d2vgetline(FILE *f, std::string& str)
         int ch = fgetc(f);
 
         if (ch == EOF)
-            break;
+            return false;
 
         if (ch == '\n') {
             if (str.size() && str[str.size() - 1] == '\r')
                 str.erase(str.size() - 1, 1);
-            break;
+            return true;
         }
 
         str += (char)ch;
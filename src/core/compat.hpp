@@ -41,6 +41,6 @@
 #define PATH_DELIM 0x2F
 #endif
 
-void d2vgetline(FILE *f, std::string& str);
+bool d2vgetline(FILE *f, std::string& str);
 
 #endif
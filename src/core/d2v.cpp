@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -34,6 +35,7 @@
 #include "d2v.hpp"
 #include <memory>
 #include "gop.hpp"
+#include "trace.hpp"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -55,17 +57,62 @@ static std::string d2vgetpath(const char *d2v_path, const std::string& file)
     return path;
 }
 
-/* Parse the entire D2V index and build the GOP and frame lists. */
-d2vcontext *d2vparse(const char *filename, std::string& err)
+/* Count the frames in a GOP line, without parsing it. */
+static int d2vcountframes(const std::string& line)
 {
-    std::string line;
+    int tokens = 0;
+    bool end   = false;
 
-    std::unique_ptr<d2vcontext> ret(new d2vcontext());
+    for (size_t i = 0; i < line.length(); i++) {
+        if (line[i] == ' ' || (i && line[i - 1] != ' '))
+            continue;
 
-    ret->stream_type   = UNSET;
-    ret->ts_pid        = -1;
-    ret->loc.startfile = -1;
+        tokens++;
+        end = !line.compare(i, 2, "ff") && (i + 2 == line.length() || line[i + 2] == ' ');
+    }
+
+    /* Skip the 7 GOP fields, and the end of stream marker. */
+    return std::max(tokens - 7 - (end ? 1 : 0), 0);
+}
+
+/* Parse a GOP line, with its per-frame flags. */
+static gop d2vparsegop(const std::string& line)
+{
+    std::istringstream ss(line);
+    gop cur_gop = {};
+
+    ss >> std::hex >> cur_gop.info;
+    ss >> std::dec >> cur_gop.matrix;
+    ss >> std::dec >> cur_gop.file;
+    ss >> std::dec >> cur_gop.pos;
+    ss >> std::dec >> cur_gop.skip;
+    ss >> std::dec >> cur_gop.vob;
+    ss >> std::dec >> cur_gop.cell;
+
+    while(!ss.eof()) {
+        uint16_t flags;
+
+        ss >> std::hex >> flags;
 
+        /*
+         * We have to use a 16-bit int to force the stringstream to
+         * read more than one character, so double check its size.
+         */
+        assert(flags <= 0xFF);
+
+        cur_gop.flags.push_back((uint8_t) flags);
+    }
+
+    /* The last flag is always 'ff' to signify the end of the stream. */
+    if (cur_gop.flags.back() == 0xFF)
+        cur_gop.flags.pop_back();
+
+    return cur_gop;
+}
+
+/* Open a D2V file, which may have a UTF-8 name. */
+static FILE *d2vopen(const char *filename, std::string& err)
+{
 #ifdef _WIN32
     wchar_t wide_filename[_MAX_PATH];
 
@@ -76,16 +123,107 @@ d2vcontext *d2vparse(const char *filename, std::string& err)
         return NULL;
     }
 
-    std::unique_ptr<FILE, decltype(&fclose)> input(_wfopen(wide_filename, L"rb"), &fclose);
+    FILE *input = _wfopen(wide_filename, L"rb");
 #else
-    std::unique_ptr<FILE, decltype(&fclose)> input(fopen(filename, "rb"), &fclose);
+    FILE *input = fopen(filename, "rb");
 #endif
 
-    if (!input) {
+    if (!input)
         err = "D2V cannot be opened.";
+
+    return input;
+}
+
+/*
+ * Read in GOP lines, starting at the current position of input. Outside
+ * the requested range, GOP lines are only counted, except for the one
+ * right before it, which may be needed to decode the first frames of
+ * an open GOP.
+ *
+ * When following a D2V which is still being written, a line that isn't
+ * terminated yet is left for the next call, along with everything after
+ * it. parse_offset always points right past the last line parsed.
+ */
+static void d2vparsegops(d2vcontext *ctx, FILE *input, std::string& preroll, bool follow)
+{
+    int first = ctx->first_frame;
+    int last  = ctx->last_frame;
+    std::string line;
+
+    while (1) {
+        if (last >= 0 && ctx->parse_frames > last) {
+            ctx->finished = true;
+            break;
+        }
+
+        bool complete = d2vgetline(input, line);
+        if (follow && !complete)
+            break;
+
+        if (!line.length()) {
+            ctx->finished = true;
+            break;
+        }
+
+        ctx->parse_offset = ftello(input);
+
+        if (!ctx->gops.size()) {
+            int count = d2vcountframes(line);
+
+            if (ctx->parse_frames + count <= first) {
+                ctx->parse_frames += count;
+                preroll.swap(line);
+                continue;
+            }
+
+            if (preroll.length())
+                ctx->gops.push_back(d2vparsegop(preroll));
+        }
+
+        gop cur_gop = d2vparsegop(line);
+
+        for (int offset = 0; offset < (int) cur_gop.flags.size(); offset++, ctx->parse_frames++) {
+            if (ctx->parse_frames < first || (last >= 0 && ctx->parse_frames > last))
+                continue;
+
+            frame f;
+            f.gop    = (int) ctx->gops.size();
+            f.offset = offset;
+            ctx->frames.push_back(f);
+        }
+
+        ctx->gops.push_back(cur_gop);
+    }
+}
+
+/*
+ * Parse the D2V index and build the GOP and frame lists, for frames
+ * first through last (inclusive) only. A negative last means until
+ * the end of the stream. If follow is set, the D2V may still be being
+ * written, and only its complete GOP lines are parsed; d2vupdate picks
+ * up the rest.
+ */
+d2vcontext *d2vparse(const char *filename, std::string& err, int first, int last, bool follow)
+{
+    tracespan span("d2vparse");
+    std::string line;
+
+    std::unique_ptr<d2vcontext> ret(new d2vcontext());
+
+    ret->stream_type   = UNSET;
+    ret->ts_pid        = -1;
+    ret->loc.startfile = -1;
+    ret->first_frame   = first;
+
+    if (first < 0 || (last >= 0 && last < first)) {
+        err = "Invalid frame range.";
         return NULL;
     }
 
+    std::unique_ptr<FILE, decltype(&fclose)> input(d2vopen(filename, err), &fclose);
+    if (!input)
+        return NULL;
+
     /* Check the DGIndexProjectFile version. */
     d2vgetline(input.get(), line);
     if (line.substr(18, 2) != D2V_VERSION && line.substr(18, 2) != "42") {
@@ -196,59 +334,119 @@ d2vcontext *d2vparse(const char *filename, std::string& err)
         return NULL;
     }
 
-    /* Read in all GOPs. */
-    int i = 0;
-    d2vgetline(input.get(), line);
-    while(line.length()) {
-        std::istringstream ss(line);
-        gop cur_gop = {};
-
-        ss >> std::hex >> cur_gop.info;
-        ss >> std::dec >> cur_gop.matrix;
-        ss >> std::dec >> cur_gop.file;
-        ss >> std::dec >> cur_gop.pos;
-        ss >> std::dec >> cur_gop.skip;
-        ss >> std::dec >> cur_gop.vob;
-        ss >> std::dec >> cur_gop.cell;
-
-        int offset = 0;
-        while(!ss.eof()) {
-            uint16_t flags;
-            frame f;
+    ret->path         = filename;
+    ret->last_frame   = last;
+    ret->parse_offset = ftello(input.get());
+    ret->parse_frames = 0;
+    ret->finished     = false;
 
-            ss >> std::hex >> flags;
+    std::string preroll;
+    d2vparsegops(ret.get(), input.get(), preroll, follow);
 
-            /*
-             * We have to use a 16-bit int to force the stringstream to
-             * read more than one character, so double check its size.
-             */
-            assert(flags <= 0xFF);
+    if (!ret->frames.size() || !ret->gops.size()) {
+        err = first ? "No frames in requested range!" : "No frames in D2V file!";
+        return NULL;
+    }
 
-            cur_gop.flags.push_back((uint8_t) flags);
+    d2vsegment seg;
+    seg.stream_type = ret->stream_type;
+    seg.ts_pid      = ret->ts_pid;
+    seg.mpeg_type   = ret->mpeg_type;
+    seg.idct_algo   = ret->idct_algo;
+    seg.first_gop   = 0;
+    seg.first_file  = 0;
+    seg.last_file   = ret->num_files - 1;
+    ret->segments.push_back(seg);
 
-            f.gop    = i;
-            f.offset = offset;
-            ret->frames.push_back(f);
+    return ret.release();
+}
 
-            offset++;
-        }
+/*
+ * Append another parsed D2V to this one, so its frames follow ours.
+ * The output is one clip, so the picture size and frame rate must match.
+ */
+bool d2vappend(d2vcontext *ctx, const d2vcontext *next, std::string& err)
+{
+    if (next->width != ctx->width || next->height != ctx->height) {
+        err = "All D2V files must have the same picture size.";
+        return false;
+    } else if ((int64_t) next->fps_num * ctx->fps_den != (int64_t) ctx->fps_num * next->fps_den) {
+        err = "All D2V files must have the same frame rate.";
+        return false;
+    } else if (next->mpeg_type != ctx->mpeg_type) {
+        /*
+         * The chroma format isn't recorded in the D2V, so it can only be
+         * checked while decoding. Different codecs are rejected here.
+         */
+        err = "All D2V files must have the same MPEG type.";
+        return false;
+    }
 
-        /* The last flag is always 'ff' to signify the end of the stream. */
-        if (cur_gop.flags.back() == 0xFF) {
-            cur_gop.flags.pop_back();
-            ret->frames.pop_back();
-        }
+    int gop_base  = (int) ctx->gops.size();
+    int file_base = ctx->num_files;
+    int seg_base  = (int) ctx->segments.size();
 
-        ret->gops.push_back(cur_gop);
-        i++;
+    ctx->files.insert(ctx->files.end(), next->files.begin(), next->files.end());
+    ctx->num_files += next->num_files;
 
-        d2vgetline(input.get(), line);
+    for (size_t i = 0; i < next->segments.size(); i++) {
+        d2vsegment seg = next->segments[i];
+
+        seg.first_gop  += gop_base;
+        seg.first_file += file_base;
+        seg.last_file  += file_base;
+        ctx->segments.push_back(seg);
     }
 
-    if (!ret->frames.size() || !ret->gops.size()) {
-        err = "No frames in D2V file!";
-        return NULL;
+    ctx->gops.reserve(ctx->gops.size() + next->gops.size());
+    for (size_t i = 0; i < next->gops.size(); i++) {
+        gop g = next->gops[i];
+
+        g.file    += file_base;
+        g.segment += seg_base;
+        ctx->gops.push_back(g);
     }
 
-    return ret.release();
+    ctx->frames.reserve(ctx->frames.size() + next->frames.size());
+    for (size_t i = 0; i < next->frames.size(); i++) {
+        frame f = next->frames[i];
+
+        f.gop += gop_base;
+        ctx->frames.push_back(f);
+    }
+
+    return true;
+}
+
+/*
+ * Parse the GOP lines appended to a D2V since it was last parsed with
+ * follow set. Returns the number of new frames, or -1 on error.
+ */
+int d2vupdate(d2vcontext *ctx, std::string& err)
+{
+    if (ctx->finished)
+        return 0;
+
+    tracespan span("d2vupdate");
+
+    std::unique_ptr<FILE, decltype(&fclose)> input(d2vopen(ctx->path.c_str(), err), &fclose);
+    if (!input)
+        return -1;
+
+    if (fseeko(input.get(), ctx->parse_offset, SEEK_SET)) {
+        err = "Cannot seek in D2V.";
+        return -1;
+    }
+
+    size_t num_frames = ctx->frames.size();
+    int num_gops      = (int) ctx->gops.size();
+
+    std::string preroll;
+    d2vparsegops(ctx, input.get(), preroll, true);
+
+    /* New GOPs belong to the last, and only, segment. */
+    for (size_t i = num_gops; i < ctx->gops.size(); i++)
+        ctx->gops[i].segment = (int) ctx->segments.size() - 1;
+
+    return (int) (ctx->frames.size() - num_frames);
 }
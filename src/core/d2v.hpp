@@ -77,6 +77,21 @@ typedef struct location {
     int endoffset;
 } location;
 
+/*
+ * A D2V file which has been appended to another. Stream parameters
+ * are tracked per segment, since they may differ between them.
+ */
+typedef struct d2vsegment {
+    enum streamtype stream_type;
+    int ts_pid;
+    int mpeg_type;
+    int idct_algo;
+
+    int first_gop;
+    int first_file;
+    int last_file;
+} d2vsegment;
+
 typedef struct d2vcontext {
     int num_files;
     std::vector<std::string> files;
@@ -92,10 +107,22 @@ typedef struct d2vcontext {
     int fps_den;
     location loc;
 
+    int first_frame; // Frame number of frames[0] in the whole stream.
+
+    /* Where parsing stopped, for following a D2V that is still being written. */
+    std::string path;
+    int last_frame;       // Last frame of the requested range, or -1 for none.
+    int64_t parse_offset; // Offset of the first GOP line not parsed yet.
+    int parse_frames;     // Frames in all GOP lines parsed so far, in or out of range.
+    bool finished;        // Whether the end of the GOP lines has been reached.
+
     std::vector<frame> frames;
     std::vector<gop> gops;
+    std::vector<d2vsegment> segments;
 } d2vcontext;
 
-d2vcontext *d2vparse(const char *filename, std::string& err);
+d2vcontext *d2vparse(const char *filename, std::string& err, int first = 0, int last = -1, bool follow = false);
+int d2vupdate(d2vcontext *ctx, std::string& err);
+bool d2vappend(d2vcontext *ctx, const d2vcontext *next, std::string& err);
 
 #endif
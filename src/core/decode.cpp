@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -27,92 +28,97 @@
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
 }
 
+#include <climits>
 #include <cstdio>
 
 #include "compat.hpp"
 #include <memory>
 #include "d2v.hpp"
 #include "decode.hpp"
+#include "demuxfilter.hpp"
 #include "gop.hpp"
+#include "trace.hpp"
 
-#ifdef _WIN32
-#include <windows.h>
-#endif
+/*
+ * The end of the current segment's files, in the virtual file. This is
+ * looked up on every use, since the sizes change when following a D2V.
+ */
+static int64_t view_end(const decodecontext *ctx)
+{
+    return ctx->files->starts[ctx->end_file + 1];
+}
 
 /*
  * AVIO seek function to handle GOP offsets and multi-file support
- * in libavformat without it knowing about it.
+ * in libavformat without it knowing about it. libavformat sees the
+ * files of the current segment as one file, starting at our GOP.
  */
 static int64_t file_seek(void *opaque, int64_t offset, int whence)
 {
     decodecontext *ctx = (decodecontext *) opaque;
+    int64_t size = view_end(ctx) - ctx->view_start;
 
     switch(whence) {
-    case SEEK_SET: {
-        /*
-         * This mutli-file seek is likely very broken, but I don't
-         * really care much, since it is only used in avformat_find_stream_info,
-         * which does its job fine as-is.
-         */
-        int64_t real_offset = offset + ctx->orig_file_offset;
-
-        for(unsigned int i = ctx->orig_file; i < ctx->cur_file; i++)
-            real_offset -= ctx->file_sizes[i];
-
-        while(real_offset > ctx->file_sizes[ctx->cur_file] && ctx->cur_file != ctx->files.size() - 1) {
-            real_offset -= ctx->file_sizes[ctx->cur_file];
-            ctx->cur_file++;
-        }
-
-        while(real_offset < 0 && ctx->cur_file) {
-            ctx->cur_file--;
-            real_offset += ctx->file_sizes[ctx->cur_file];
-        }
-
-        fseeko(ctx->files[ctx->cur_file], real_offset, SEEK_SET);
-
-        return offset;
-    }
-    case AVSEEK_SIZE: {
-        /*
-         * Return the total filesize of all files combined,
-         * adjusted for GOP offset.
-         */
-        int64_t size = -((int64_t) ctx->orig_file_offset);
-        unsigned int i;
-
-        for(i = ctx->orig_file; i < ctx->file_sizes.size(); i++)
-            size += ctx->file_sizes[i];
-
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += ctx->view_pos;
+        break;
+    case SEEK_END:
+        offset += size;
+        break;
+    case AVSEEK_SIZE:
         return size;
-    }
     default:
         /* Shouldn't need to support anything else for our use case. */
         std::cout << "Unsupported seek!" << std::endl;
         return -1;
     }
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    ctx->view_pos = offset;
+
+    if (ctx->opts.prefilter)
+        demuxfilterreset(&ctx->filter, ctx->filter.stream_type, ctx->filter.ts_pid);
+
+    return offset;
 }
 
 /*
  * AVIO packet reading function to handle GOP offsets and multi-file support
- * in libavformat without it knowing about it.
+ * in libavformat without it knowing about it. Reads continue seamlessly
+ * across as many files as needed.
  */
 static int read_packet(void *opaque, uint8_t *buf, int size)
 {
     decodecontext *ctx = (decodecontext *) opaque;
+    int64_t offset = ctx->view_start + ctx->view_pos;
+    int64_t want   = std::min<int64_t>(size, view_end(ctx) - offset);
+
+    if (want <= 0)
+        return AVERROR_EOF;
+
+    int64_t ret = filecachereadat(ctx->files.get(), offset, buf, want);
+    if (ret < 0)
+        return AVERROR(EIO);
+
+    ctx->view_pos         += ret;
+    ctx->stats.bytes_read += ret;
 
     /*
-     * If we read in less than we got asked for, and we're
-     * not on the last file, then start reading seamlessly
-     * on the next file.
+     * Drop the streams we don't decode before libavformat sees them.
+     * Incomplete headers at the end are left for the next read.
      */
-    size_t ret = fread(buf, 1, size, ctx->files[ctx->cur_file]);
-    if (ret < (size_t) size && ctx->cur_file != ctx->files.size() - 1) {
-        ctx->cur_file++;
-        fseeko(ctx->files[ctx->cur_file], 0, SEEK_SET);
-        ret += fread(buf + ret, 1, size - ret, ctx->files[ctx->cur_file]);
+    if (ctx->opts.prefilter && ret > 0) {
+        int keep = demuxfilterrun(&ctx->filter, buf, (int) ret, (int) ret - 1);
+
+        ret           -= keep;
+        ctx->view_pos -= keep;
     }
 
     return ret == 0 ? AVERROR_EOF : static_cast<int>(ret);
@@ -124,6 +130,10 @@ decodecontext::~decodecontext()
     av_freep(&in);
     av_packet_free(&inpkt);
 
+    for (auto& e : packets)
+        for (AVPacket *pkt : e.second.packets)
+            av_packet_free(&pkt);
+
     if (fctx) {
         if (fctx->pb)
             av_freep(&fctx->pb);
@@ -131,56 +141,102 @@ decodecontext::~decodecontext()
         avformat_close_input(&fctx);
     }
 
-    for (size_t i = 0; i < files.size(); i++)
-        fclose(files[i]);
-
     if (avctx) {
         avcodec_free_context(&avctx);
     }
 }
 
-/* Initialize everything we can with regards to decoding */
-decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err)
+/*
+ * (Re)open the decoder for a segment. Anything the caller set on a
+ * previous codec context, like its get_buffer2, is carried over.
+ */
+static int decodeopencodec(decodecontext *ctx, const d2vsegment *seg, std::string& err)
 {
-    std::unique_ptr<decodecontext> ret(new decodecontext());
+    /* Set the correct decoder. */
+    if (seg->mpeg_type == 1) {
+        ctx->incodec = avcodec_find_decoder(AV_CODEC_ID_MPEG1VIDEO);
+    } else if (seg->mpeg_type == 2) {
+        ctx->incodec = avcodec_find_decoder(AV_CODEC_ID_MPEG2VIDEO);
+    } else if (seg->mpeg_type == 264) {
+        ctx->incodec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    } else {
+        err = "Invalid MPEG Type.";
+        return -1;
+    }
 
-    /* Set our stream index to -1 (uninitialized). */
-    ret->stream_index = -1;
+    /* Allocate the codec's context. */
+    AVCodecContext *avctx = avcodec_alloc_context3(ctx->incodec);
+    if (!avctx) {
+        err = "Cannot allocate AVCodecContext.";
+        return -1;
+    }
 
-    /* Open each file and stash its size. */
-    for(int i = 0; i < dctx->num_files; i++) {
-        FILE *in;
-        int64_t size;
+    if (ctx->avctx) {
+        avctx->opaque      = ctx->avctx->opaque;
+        avctx->get_buffer2 = ctx->avctx->get_buffer2;
+        avcodec_free_context(&ctx->avctx);
+    }
+    ctx->avctx = avctx;
 
-#ifdef _WIN32
-        wchar_t filename[_MAX_PATH];
+    /* Set the IDCT algorithm. */
+    ctx->avctx->idct_algo = seg->idct_algo;
 
-        size = MultiByteToWideChar(CP_UTF8, 0, dctx->files[i].c_str(), -1, filename, ARRAYSIZE(filename));
-        if (!size) {
-            err  = "Cannot parse file name: ";
-            err += dctx->files[i];
-            return NULL;
-        }
+    /* Set the thread count. */
+    ctx->avctx->thread_count = ctx->threads;
 
-        in = _wfopen(filename, L"rb");
-#else
-        in = fopen(dctx->files[i].c_str(), "rb");
-#endif
+    /* Set up draft decoding, if requested. */
+    if (ctx->opts.lowres > ctx->incodec->max_lowres) {
+        err = "Decoding at reduced size is only supported for MPEG-1/2.";
+        return -1;
+    }
 
-        if (!in) {
-            err  = "Cannot open file: ";
-            err += dctx->files[i];
-            return NULL;
-        }
+    ctx->avctx->lowres = ctx->opts.lowres;
+
+    if (ctx->opts.gray)
+        ctx->avctx->flags |= AV_CODEC_FLAG_GRAY;
+
+    if (ctx->opts.fast) {
+        ctx->avctx->flags2          |= AV_CODEC_FLAG2_FAST;
+        ctx->avctx->skip_loop_filter = AVDISCARD_ALL;
+    }
+
+    /* Let the bitstream's motion vectors and quantizers be used downstream. */
+    if (ctx->opts.export_mvs)
+        ctx->avctx->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
 
-        fseeko(in, 0, SEEK_END);
-        size = ftello(in);
-        fseeko(in, 0, SEEK_SET);
+    if (ctx->opts.export_qp)
+        ctx->avctx->export_side_data |= AV_CODEC_EXPORT_DATA_VIDEO_ENC_PARAMS;
 
-        ret->file_sizes.push_back(size);
-        ret->files.push_back(in);
+    /* Open it. */
+    int av_ret = avcodec_open2(ctx->avctx, ctx->incodec, NULL);
+    if (av_ret < 0) {
+        err = "Cannot open decoder.";
+        return -1;
     }
 
+    ctx->mpeg_type = seg->mpeg_type;
+    ctx->idct_algo = seg->idct_algo;
+
+    return 0;
+}
+
+/* Initialize everything we can with regards to decoding */
+decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err, const decodeoptions *opts)
+{
+    tracespan span("decodeinit");
+    std::unique_ptr<decodecontext> ret(new decodecontext());
+
+    /* Set our stream index to -1 (uninitialized). */
+    ret->stream_index = -1;
+
+    /*
+     * Stash the size of each file. They are only opened once
+     * we need to read from them.
+     */
+    ret->files.reset(filecacheinit(dctx->files, err));
+    if (!ret->files)
+        return NULL;
+
     /*
      * Register all of our demuxers, parsers, and decoders.
      * Ideally, to create a smaller binary, we only enable the
@@ -192,37 +248,20 @@ decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err)
      */
     /* API calls no longer needed, but comment left for info purposes. */
 
-    /* Set the correct decoder. */
-    if (dctx->mpeg_type == 1) {
-        ret->incodec = avcodec_find_decoder(AV_CODEC_ID_MPEG1VIDEO);
-    } else if (dctx->mpeg_type == 2) {
-        ret->incodec = avcodec_find_decoder(AV_CODEC_ID_MPEG2VIDEO);
-    } else if (dctx->mpeg_type == 264) {
-        ret->incodec = avcodec_find_decoder(AV_CODEC_ID_H264);
-    } else {
-        err = "Invalid MPEG Type.";
-        return NULL;
-    }
-
-    /* Allocate the codec's context. */
-    ret->avctx = avcodec_alloc_context3(ret->incodec);
-    if (!ret->avctx) {
-        err = "Cannot allocate AVCodecContext.";
-        return NULL;
-    }
+    ret->threads = threads;
+    if (opts)
+        ret->opts = *opts;
 
-    /* Set the IDCT algorithm. */
-    ret->avctx->idct_algo = dctx->idct_algo;
+    ret->files->hints = ret->opts.io_hints;
 
-    /* Set the thread count. */
-    ret->avctx->thread_count = threads;
+    ret->replay_gop = -1;
+    ret->record_gop = -1;
 
-    /* Open it. */
-    int av_ret = avcodec_open2(ret->avctx, ret->incodec, NULL);
-    if (av_ret < 0) {
-        err = "Cannot open decoder.";
+    if (decodeopencodec(ret.get(), &dctx->segments[0], err) < 0)
         return NULL;
-    }
+
+    ret->cur_segment = 0;
+    ret->end_file    = dctx->segments[0].last_file;
 
     /* Allocate the scratch buffer for our custom AVIO context. */
     ret->in = (uint8_t *) av_malloc(32 * 1024);
@@ -243,13 +282,329 @@ decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err)
     return ret.release();
 }
 
+/* Free out format and AVIO contexts from the previous seek. */
+static void decodeclose(decodecontext *dctx)
+{
+    if (dctx->fctx) {
+        if (dctx->fctx->pb)
+            av_freep(&dctx->fctx->pb);
+
+        avformat_close_input(&dctx->fctx);
+    }
+}
+
+/*
+ * Moving to another segment needs a different decoder if
+ * its stream parameters differ, and a new stream index.
+ */
+static int decodesegment(d2vcontext *ctx, decodecontext *dctx, int segment, std::string& err)
+{
+    const d2vsegment *seg = &ctx->segments[segment];
+
+    if (dctx->cur_segment != segment) {
+        if (seg->mpeg_type != dctx->mpeg_type || seg->idct_algo != dctx->idct_algo) {
+            if (decodeopencodec(dctx, seg, err) < 0)
+                return -1;
+        }
+
+        dctx->cur_segment  = segment;
+        dctx->end_file     = seg->last_file;
+        dctx->stream_index = -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Open the demuxer at the start of a GOP in the current segment,
+ * and find the stream we are decoding.
+ */
+static int decodeseek(d2vcontext *ctx, decodecontext *dctx, const gop& g, std::string& err)
+{
+    const d2vsegment *seg = &ctx->segments[dctx->cur_segment];
+
+    decodeclose(dctx);
+
+    /* Seek to our GOP offset and stash the info. */
+    dctx->view_start = dctx->files->starts[g.file] + (int64_t) g.pos;
+    dctx->view_pos   = 0;
+
+    if (dctx->opts.prefilter)
+        demuxfilterreset(&dctx->filter, seg->stream_type, seg->ts_pid);
+
+    /* Allocate format context. */
+    dctx->fctx = avformat_alloc_context();
+    if (!dctx->fctx) {
+        err = "Cannot allocate AVFormatContext.";
+        return -1;
+    }
+
+    /*
+     * Find the demuxer for our input type, and also set
+     * the "filename" that we pass to libavformat when
+     * we open the demuxer with our custom AVIO context.
+     */
+    if (seg->stream_type == ELEMENTARY) {
+        if (seg->mpeg_type == 264) {
+            dctx->fctx->iformat = av_find_input_format("h264");
+            dctx->fakename  = "fakevideo.h264";
+        } else {
+            dctx->fctx->iformat = av_find_input_format("mpegvideo");
+            dctx->fakename  = "fakevideo.m2v";
+        }
+    } else if (seg->stream_type == PROGRAM) {
+        dctx->fctx->iformat = av_find_input_format("mpeg");
+        dctx->fakename      = "fakevideo.vob";
+    } else if (seg->stream_type == TRANSPORT) {
+        dctx->fctx->iformat = av_find_input_format("mpegts");
+        dctx->fakename      = "fakevideo.ts";
+    } else {
+        err = "Unsupported format.";
+        avformat_close_input(&dctx->fctx);
+        return -1;
+    }
+
+    /*
+     * Initialize out custom AVIO context that libavformat
+     * will use instead of a file. It uses our custom packet
+     * reading and seeking functions that transparently work
+     * with our indexed GOP offsets and multiple files.
+     */
+    dctx->fctx->pb = avio_alloc_context(dctx->in, 32 * 1024, 0, dctx, read_packet, NULL, file_seek);
+
+    /* Open the demuxer. */
+    int64_t open_time = av_gettime_relative();
+    tracespan open_span("avformat_open_input");
+    int av_ret = avformat_open_input(&dctx->fctx, dctx->fakename, NULL, NULL);
+    open_span.end();
+    if (av_ret < 0) {
+        err = "Cannot open buffer in libavformat.";
+        avformat_close_input(&dctx->fctx);
+        return -1;
+    }
+    dctx->stats.reopens++;
+    dctx->stats.open_time += av_gettime_relative() - open_time;
+
+    /*
+     * Call the abomination function to find out
+     * how many streams we have.
+     */
+    int64_t probe_time = av_gettime_relative();
+    tracespan probe_span("avformat_find_stream_info");
+    avformat_find_stream_info(dctx->fctx, NULL);
+    probe_span.end();
+    dctx->stats.probe_time += av_gettime_relative() - probe_time;
+
+    /* Free and re-initialize any existing packet. */
+    av_packet_unref(dctx->inpkt);
+
+    /*
+     * Set our stream index if we need to.
+     * Set it to the stream that matches our MPEG-TS PID if applicable.
+     */
+    if (dctx->stream_index == -1) {
+        unsigned int i;
+
+        if (seg->ts_pid > 0) {
+            for(i = 0; i < dctx->fctx->nb_streams; i++)
+                if (dctx->fctx->streams[i]->id == seg->ts_pid)
+                    break;
+        } else {
+            for(i = 0; i < dctx->fctx->nb_streams; i++)
+                if (dctx->fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+                    break;
+        }
+
+        if (i >= dctx->fctx->nb_streams) {
+            if (seg->ts_pid > 0)
+                err = "PID does not exist in source file.";
+            else
+                err = "No video stream found.";
+
+            avformat_close_input(&dctx->fctx);
+            return -1;
+        }
+
+        dctx->stream_index = (int) i;
+    }
+
+    return 0;
+}
+
+/* Read the next packet of our stream from the demuxer. */
+static int decodedemux(decodecontext *dctx)
+{
+    do {
+        av_packet_unref(dctx->inpkt);
+
+        if (av_read_frame(dctx->fctx, dctx->inpkt) < 0)
+            return -1;
+    } while (dctx->inpkt->stream_index != dctx->stream_index);
+
+    return 0;
+}
+
+/* Drop the least recently used cache entries, other than the one being recorded, until size more bytes fit. */
+static bool decodecacheevict(decodecontext *dctx, int64_t size)
+{
+    while (dctx->packets_size + size > dctx->opts.packet_cache_size) {
+        auto lru = dctx->packets.end();
+
+        for (auto it = dctx->packets.begin(); it != dctx->packets.end(); ++it)
+            if (it->first != dctx->record_gop && (lru == dctx->packets.end() || it->second.last_used < lru->second.last_used))
+                lru = it;
+
+        if (lru == dctx->packets.end())
+            return false;
+
+        for (AVPacket *pkt : lru->second.packets)
+            av_packet_free(&pkt);
+
+        dctx->packets_size -= lru->second.size;
+        dctx->packets.erase(lru);
+    }
+
+    return true;
+}
+
+/*
+ * Get the next packet of our stream into dctx->inpkt, from the packet
+ * cache while it lasts, and from the demuxer after that. Packets from
+ * the demuxer are added to the cache entry being recorded. At the end
+ * of the stream, a blank packet is returned, which drains the decoder.
+ */
+static int decoderead(d2vcontext *ctx, decodecontext *dctx, std::string& err)
+{
+    av_packet_unref(dctx->inpkt);
+
+    if (dctx->replay_gop >= 0) {
+        const packetcacheentry& e = dctx->packets[dctx->replay_gop];
+
+        if (dctx->replay_pos < e.packets.size()) {
+            if (av_packet_ref(dctx->inpkt, e.packets[dctx->replay_pos++]) < 0) {
+                err = "Cannot reference cached packet.";
+                return -1;
+            }
+            return 0;
+        }
+
+        /*
+         * Out of cached packets, so open the demuxer at the same GOP,
+         * and skip the packets already fed to the decoder.
+         */
+        tracespan span("packetcachemiss");
+
+        if (decodeseek(ctx, dctx, ctx->gops[dctx->replay_gop], err) < 0)
+            return -1;
+
+        dctx->replay_gop = -1;
+
+        for (size_t i = 0; i < e.packets.size(); i++)
+            if (decodedemux(dctx) < 0)
+                return 0;
+    }
+
+    if (decodedemux(dctx) < 0)
+        return 0;
+
+    if (dctx->record_gop >= 0) {
+        packetcacheentry& e = dctx->packets[dctx->record_gop];
+        AVPacket *pkt = NULL;
+
+        if (decodecacheevict(dctx, dctx->inpkt->size))
+            pkt = av_packet_clone(dctx->inpkt);
+
+        /* Stop recording once a packet doesn't fit. The entry is still valid up to here. */
+        if (!pkt) {
+            dctx->record_gop = -1;
+            return 0;
+        }
+
+        e.packets.push_back(pkt);
+        e.size             += pkt->size;
+        dctx->packets_size += pkt->size;
+    }
+
+    return 0;
+}
+
+/*
+ * Let the kernel read ahead what a seek to a GOP is going to need: the
+ * GOP itself, and the next one, which is where open GOPs are decoded.
+ */
+static void decodeprefetch(d2vcontext *ctx, decodecontext *dctx, int gop_num)
+{
+    const gop& g = ctx->gops[gop_num];
+    int64_t size = FILECACHE_PREFETCH_MAX;
+
+    if (gop_num + 2 < (int) ctx->gops.size() && ctx->gops[gop_num + 2].file == g.file)
+        size = std::min<int64_t>((int64_t) (ctx->gops[gop_num + 2].pos - g.pos), size);
+
+    if (size > 0)
+        filecacheprefetch(dctx->files.get(), g.file, (int64_t) g.pos, size);
+}
+
+/*
+ * Start decoding from a GOP. If its packets are cached, they are fed to
+ * the decoder without opening the demuxer at all. Otherwise, the demuxer
+ * is opened there, and what it reads is cached.
+ */
+static int decodestart(d2vcontext *ctx, decodecontext *dctx, int gop_num, std::string& err)
+{
+    const gop& g = ctx->gops[gop_num];
+
+    if (decodesegment(ctx, dctx, g.segment, err) < 0)
+        return -1;
+
+    /* Flush the buffers of our codec's context so we don't need to re-initialize it. */
+    avcodec_flush_buffers(dctx->avctx);
+
+    dctx->replay_gop = -1;
+    dctx->record_gop = -1;
+
+    if (!dctx->opts.packet_cache_size) {
+        decodeprefetch(ctx, dctx, gop_num);
+        return decodeseek(ctx, dctx, g, err);
+    }
+
+    auto it = dctx->packets.find(gop_num);
+    if (it != dctx->packets.end() && !it->second.packets.empty()) {
+        decodeclose(dctx);
+
+        it->second.last_used = ++dctx->packets_use_count;
+        dctx->replay_gop     = gop_num;
+        dctx->replay_pos     = 0;
+        dctx->record_gop     = gop_num;
+        dctx->stats.packet_cache_hits++;
+
+        return 0;
+    }
+
+    decodeprefetch(ctx, dctx, gop_num);
+
+    if (decodeseek(ctx, dctx, g, err) < 0)
+        return -1;
+
+    packetcacheentry& e = dctx->packets[gop_num];
+    e.last_used      = ++dctx->packets_use_count;
+    dctx->record_gop = gop_num;
+
+    return 0;
+}
+
 int decodeframe(int frame_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *out, std::string& err)
 {
     bool next = true;
+    int64_t start_time = av_gettime_relative();
+    tracespan span("decodeframe");
 
-    /* Get our frame and the GOP its in. */
+    /* Get our frame and the GOP its in, without copying its flags. */
     frame f = ctx->frames[frame_num];
-    gop g = ctx->gops[f.gop];
+    const gop *g = &ctx->gops[f.gop];
+
+    /* Appended D2V files each start over with their own GOPs. */
+    int segment = g->segment;
+    const d2vsegment *seg = &ctx->segments[segment];
 
     /*
      * The offset is how many frames we have to decode from our
@@ -260,13 +615,16 @@ int decodeframe(int frame_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *ou
      */
     int offset = f.offset;
 
+    /* The GOP decoding starts from, if we have to seek. */
+    int start_gop = f.gop;
+
     /*
      * If we're in a open GOP situation, then start decoding
      * from the previous GOP (one at most is needed), and adjust
      * out offset accordingly.
      */
-    if (!(g.info & GOP_FLAG_CLOSED)) {
-        if (f.gop == 0) {
+    if (!(g->info & GOP_FLAG_CLOSED)) {
+        if (f.gop == seg->first_gop) {
             int n = 0;
 
             /*
@@ -274,7 +632,7 @@ int decodeframe(int frame_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *ou
              * that require of the previous GOP when the
              * first GOP is open.
              */
-            while(!(g.flags[n] & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP))
+            while(!(g->flags[n] & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP))
                 n++;
 
             /*
@@ -291,30 +649,25 @@ int decodeframe(int frame_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *ou
              */
             next = offset != 0;
         } else {
-            int n = frame_num;
-            frame t = ctx->frames[n];
-
-            g = ctx->gops[f.gop - 1];
-
-            /*
-             * Find the offset of the last frame in the
-             * previous GOP and add it to our offset.
-             */
-            while(t.offset)
-                t = ctx->frames[--n];
+            int n = 0;
 
-            t = ctx->frames[--n];
+            start_gop = f.gop - 1;
+            g         = &ctx->gops[start_gop];
 
             /*
              * Subtract number of frames that require the
              * previous GOP.
              */
-            n = 0;
-            if (!(g.info & GOP_FLAG_CLOSED))
-                while(!(g.flags[n] & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP))
+            if (!(g->info & GOP_FLAG_CLOSED))
+                while(!(g->flags[n] & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP))
                     n++;
 
-            offset += t.offset + 1 - n;
+            /*
+             * Add the number of frames in the previous GOP to our offset.
+             * Its frames may not be in our frame list at all, if it is only
+             * there to decode the start of a range.
+             */
+            offset += (int) g->flags.size() - n;
         }
     }
 
@@ -324,154 +677,161 @@ int decodeframe(int frame_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *ou
      * the same, or also linear. If so, we can decode
      * linearly.
      */
-    next = next && (dctx->last_gop == f.gop || dctx->last_gop == f.gop - 1) && dctx->last_frame == frame_num - 1;
+    next = next && (dctx->last_gop == f.gop || dctx->last_gop == f.gop - 1) && dctx->last_frame == frame_num - 1 &&
+           dctx->cur_segment == segment;
 
     /* Skip GOP initialization if we're decoding linearly. */
-    if (!next) {
-        /* Free out format and AVIO contexts from the previous seek. */
-        if (dctx->fctx) {
-            if (dctx->fctx->pb)
-                av_freep(&dctx->fctx->pb);
+    if (!next && decodestart(ctx, dctx, start_gop, err) < 0)
+        return -1;
 
-            avformat_close_input(&dctx->fctx);
-        }
+    /* Only the start GOP and the one after it are worth caching. */
+    if (dctx->record_gop >= 0 && f.gop > dctx->record_gop + 1)
+        dctx->record_gop = -1;
 
-        /* Seek to our GOP offset and stash the info. */
-        fseeko(dctx->files[g.file], g.pos, SEEK_SET);
-        dctx->orig_file_offset = g.pos;
-        dctx->orig_file        = g.file;
-        dctx->cur_file         = g.file;
+    /*
+     * We don't need to read a new packet in if we are decoding
+     * linearly, since it's still there from the previous iteration.
+     */
+    if (!next && decoderead(ctx, dctx, err) < 0)
+        return -1;
 
-        /* Allocate format context. */
-        dctx->fctx = avformat_alloc_context();
-        if (!dctx->fctx) {
-            err = "Cannot allocate AVFormatContext.";
-            return -1;
-        }
+    /* If we're decoding linearly, there is obviously no offset. */
+    int o = next ? 0 : offset;
+    for(int j = 0; j <= o; j++) {
+        while (avcodec_receive_frame(dctx->avctx, out) == AVERROR(EAGAIN)) {
+            avcodec_send_packet(dctx->avctx, dctx->inpkt);
 
-        /*
-         * Find the demuxer for our input type, and also set
-         * the "filename" that we pass to libavformat when
-         * we open the demuxer with our custom AVIO context.
-         */
-        if (ctx->stream_type == ELEMENTARY) {
-            if (ctx->mpeg_type == 264) {
-                dctx->fctx->iformat = av_find_input_format("h264");
-                dctx->fakename  = "fakevideo.h264";
-            } else {
-                dctx->fctx->iformat = av_find_input_format("mpegvideo");
-                dctx->fakename  = "fakevideo.m2v";
-            }
-        } else if (ctx->stream_type == PROGRAM) {
-            dctx->fctx->iformat = av_find_input_format("mpeg");
-            dctx->fakename      = "fakevideo.vob";
-        } else if (ctx->stream_type == TRANSPORT) {
-            dctx->fctx->iformat = av_find_input_format("mpegts");
-            dctx->fakename      = "fakevideo.ts";
-        } else {
-            err = "Unsupported format.";
-            avformat_close_input(&dctx->fctx);
-            return -1;
+            if (decoderead(ctx, dctx, err) < 0)
+                return -1;
         }
 
-        /*
-         * Initialize out custom AVIO context that libavformat
-         * will use instead of a file. It uses our custom packet
-         * reading and seeking functions that transparently work
-         * with our indexed GOP offsets and multiple files.
-         */
-        dctx->fctx->pb = avio_alloc_context(dctx->in, 32 * 1024, 0, dctx, read_packet, NULL, file_seek);
+        /* Unreference all but the last frame. */
+        if (j != o)
+            av_frame_unref(out);
+    }
 
-        /* Open the demuxer. */
-        int av_ret = avformat_open_input(&dctx->fctx, dctx->fakename, NULL, NULL);
-        if (av_ret < 0) {
-            err = "Cannot open buffer in libavformat.";
-            avformat_close_input(&dctx->fctx);
-            return -1;
-        }
+    int64_t decode_time = av_gettime_relative() - start_time;
 
-        /*
-         * Flush the buffers of our codec's context so we
-         * don't need to re-initialize it.
-         */
-        avcodec_flush_buffers(dctx->avctx);
+    dctx->stats.frames_decoded   += o + 1;
+    dctx->stats.frames_discarded += o;
+    dctx->stats.decode_time      += decode_time;
+    if (!next)
+        dctx->stats.seeks++;
 
-        /*
-         * Call the abomination function to find out
-         * how many streams we have.
-         */
-        avformat_find_stream_info(dctx->fctx, NULL);
+    span.arg("frame", frame_num);
+    span.arg("gop", f.gop);
+    span.arg("offset", o);
+    span.arg("seek", !next);
 
-        /* Free and re-initialize any existing packet. */
-        av_packet_unref(dctx->inpkt);
-    }
+    dctx->last_seek        = !next;
+    dctx->last_discarded   = o;
+    dctx->last_decode_time = decode_time;
 
     /*
-     * Set our stream index if we need to.
-     * Set it to the stream that matches our MPEG-TS PID if applicable.
+     * Stash the frame number we just decoded, and the GOP it
+     * is a part of so we can check if we're decoding linearly
+     * later on.
      */
-    if (dctx->stream_index == -1) {
-        unsigned int i;
+    dctx->last_gop   = f.gop;
+    dctx->last_frame = frame_num;
 
-        if (ctx->ts_pid > 0) {
-            for(i = 0; i < dctx->fctx->nb_streams; i++)
-                if (dctx->fctx->streams[i]->id == ctx->ts_pid)
-                    break;
-        } else {
-            for(i = 0; i < dctx->fctx->nb_streams; i++)
-                if (dctx->fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-                    break;
-        }
+    return 0;
+}
 
-        if (i >= dctx->fctx->nb_streams) {
-            if (ctx->ts_pid > 0)
-                err = "PID does not exist in source file.";
-            else
-                err = "No video stream found.";
+/*
+ * Decode the first intra picture of a GOP on its own, without decoding
+ * anything from the previous GOP. Only its first few packets are read.
+ */
+int decodekeyframe(int gop_num, d2vcontext *ctx, decodecontext *dctx, AVFrame *out, std::string& err)
+{
+    int64_t start_time = av_gettime_relative();
+    tracespan span("decodekeyframe");
 
-            avformat_close_input(&dctx->fctx);
-            return -1;
-        }
+    const gop& g = ctx->gops[gop_num];
 
-        dctx->stream_index = (int) i;
-    }
+    decodeprefetch(ctx, dctx, gop_num);
+
+    if (decodesegment(ctx, dctx, g.segment, err) < 0 || decodeseek(ctx, dctx, g, err) < 0)
+        return -1;
+
+    avcodec_flush_buffers(dctx->avctx);
+
+    /* Nothing read here is cached, or replayed. */
+    dctx->replay_gop = -1;
+    dctx->record_gop = -1;
 
     /*
-     * We don't need to read a new packet in if we are decoding
-     * linearly, since it's still there from the previous iteration.
+     * Skip anything that isn't intra coded, and drain the decoder after
+     * every packet, so the picture is returned without waiting on the
+     * next reference frame.
      */
-    if (!next)
-        av_read_frame(dctx->fctx, dctx->inpkt);
+    dctx->avctx->skip_frame = AVDISCARD_NONINTRA;
 
-    /* If we're decoding linearly, there is obviously no offset. */
-    int o = next ? 0 : offset;
-    for(int j = 0; j <= o; j++) {
-        while(dctx->inpkt->stream_index != dctx->stream_index) {
-            av_packet_unref(dctx->inpkt);
-            av_read_frame(dctx->fctx, dctx->inpkt);
-        }
+    int packets = 0;
+    int av_ret  = AVERROR(EAGAIN);
+    while (av_ret < 0 && packets < (int) g.flags.size()) {
+        if (av_read_frame(dctx->fctx, dctx->inpkt) < 0)
+            break;
 
-        while (avcodec_receive_frame(dctx->avctx, out) == AVERROR(EAGAIN)) {
+        if (dctx->inpkt->stream_index == dctx->stream_index) {
             avcodec_send_packet(dctx->avctx, dctx->inpkt);
+            avcodec_send_packet(dctx->avctx, NULL);
 
-            do {
-                av_packet_unref(dctx->inpkt);
-                av_read_frame(dctx->fctx, dctx->inpkt);
-            } while(dctx->inpkt->stream_index != dctx->stream_index);
+            av_ret = avcodec_receive_frame(dctx->avctx, out);
+            avcodec_flush_buffers(dctx->avctx);
+            packets++;
         }
 
-        /* Unreference all but the last frame. */
-        if (j != o)
-            av_frame_unref(out);
+        av_packet_unref(dctx->inpkt);
+    }
+
+    dctx->avctx->skip_frame = AVDISCARD_DEFAULT;
+
+    if (av_ret < 0) {
+        err = "No intra picture found in GOP.";
+        return -1;
     }
 
+    int64_t decode_time = av_gettime_relative() - start_time;
+
+    dctx->stats.frames_decoded++;
+    dctx->stats.decode_time += decode_time;
+    dctx->stats.seeks++;
+
+    span.arg("gop", gop_num);
+    span.arg("packets", packets);
+
+    dctx->last_seek        = true;
+    dctx->last_discarded   = 0;
+    dctx->last_decode_time = decode_time;
+
+    /* The next decodeframe() call can't continue from here. */
+    dctx->last_gop   = INT_MIN;
+    dctx->last_frame = INT_MIN;
+
+    return 0;
+}
+
+/*
+ * Pick up the GOPs appended to a D2V that is still being written, along
+ * with the new sizes of its source files. Returns the number of new
+ * frames, or -1 on error.
+ */
+int decodefollow(d2vcontext *ctx, decodecontext *dctx, std::string& err)
+{
+    int added = d2vupdate(ctx, err);
+    if (added <= 0)
+        return added;
+
+    if (!filecacheupdate(dctx->files.get(), err))
+        return -1;
+
     /*
-     * Stash the frame number we just decoded, and the GOP it
-     * is a part of so we can check if we're decoding linearly
-     * later on.
+     * The demuxer and decoder may already have hit the old end of
+     * the files, so start over from a seek for the next frame.
      */
-    dctx->last_gop   = f.gop;
-    dctx->last_frame = frame_num;
+    dctx->last_gop   = INT_MIN;
+    dctx->last_frame = INT_MIN;
 
-    return 0;
+    return added;
 }
@@ -28,11 +28,62 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "demuxfilter.hpp"
+#include "filecache.hpp"
+
+/*
+ * Running counters for a decoding context. They are only ever
+ * written by whoever is decoding, but may be read from any thread.
+ * All times are in microseconds.
+ */
+typedef struct decodestats {
+    std::atomic<int64_t> frames_requested;
+    std::atomic<int64_t> frames_returned;
+    std::atomic<int64_t> frames_predecoded;
+    std::atomic<int64_t> frames_decoded;
+    std::atomic<int64_t> frames_discarded;
+    std::atomic<int64_t> seeks;
+    std::atomic<int64_t> packet_cache_hits;
+    std::atomic<int64_t> reopens;
+    std::atomic<int64_t> bytes_read;
+    std::atomic<int64_t> open_time;
+    std::atomic<int64_t> probe_time;
+    std::atomic<int64_t> decode_time;
+    std::atomic<int64_t> copy_time;
+} decodestats;
+
+/* Optional decoder settings, which trade quality for speed. */
+typedef struct decodeoptions {
+    int lowres; // Decode at 1/2^lowres of the size. MPEG-1/2 only.
+    bool gray;  // Skip decoding chroma.
+    bool fast;  // Allow non-compliant speedups, and skip the H.264 loop filter.
+
+    int64_t packet_cache_size; // Bytes of demuxed packets to keep, or 0 for none.
+    bool prefilter;            // Hide other streams from libavformat. See demuxfilter.
+    bool io_hints;             // Tell the kernel how the source files are read. See filecache.
+
+    bool export_mvs; // Attach motion vectors to decoded frames, as side data.
+    bool export_qp;  // Attach quantizers to decoded frames, as video encoding parameters.
+} decodeoptions;
+
+/*
+ * The packets of our stream read after seeking to a GOP, in decode order,
+ * so seeking there again can skip the file access and demuxing.
+ */
+typedef struct packetcacheentry {
+    std::vector<AVPacket *> packets;
+    int64_t size;
+    uint64_t last_used;
+} packetcacheentry;
 
 typedef struct decodecontext {
-    std::vector<FILE *> files;
-    std::vector<int64_t> file_sizes;
+    std::unique_ptr<filecache> files;
 
     AVCodecContext *avctx;
     AVFormatContext *fctx;
@@ -41,20 +92,49 @@ typedef struct decodecontext {
 
     AVPacket *inpkt;
 
+    int threads;
+    decodeoptions opts;
+    int mpeg_type;
+    int idct_algo;
+
     int stream_index;
+    int cur_segment;
 
     int last_frame;
     int last_gop;
 
+    /* Cached packets, by the GOP decoding was started from. */
+    std::map<int, packetcacheentry> packets;
+    int64_t packets_size;
+    uint64_t packets_use_count;
+    int replay_gop; // GOP whose cached packets are being fed to the decoder, or -1.
+    size_t replay_pos;
+    int record_gop; // GOP whose entry newly demuxed packets are added to, or -1.
+
+    /* What it took to decode the last frame. */
+    bool last_seek;
+    int last_discarded;
+    int64_t last_decode_time;
+
+    decodestats stats;
+
     uint8_t *in;
+    demuxfilter filter;
+
+    /*
+     * What libavformat sees as its input file: the files of the current
+     * segment, as one virtual file starting at the GOP we seeked to.
+     */
+    int end_file;       // Last file of the segment.
+    int64_t view_start; // Offset of the GOP in the virtual file.
+    int64_t view_pos;   // Position relative to view_start.
 
-    unsigned int orig_file;
-    unsigned int cur_file;
-    uint64_t orig_file_offset;
     ~decodecontext();
 } decodecontext;
 
-decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err);
+decodecontext *decodeinit(d2vcontext *dctx, int threads, std::string& err, const decodeoptions *opts = NULL);
 int decodeframe(int frame, d2vcontext *ctx, decodecontext *dctx, AVFrame *out, std::string& err);
+int decodekeyframe(int gop, d2vcontext *ctx, decodecontext *dctx, AVFrame *out, std::string& err);
+int decodefollow(d2vcontext *ctx, decodecontext *dctx, std::string& err);
 
 #endif
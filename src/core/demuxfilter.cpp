@@ -0,0 +1,298 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "d2v.hpp"
+#include "demuxfilter.hpp"
+
+#define PS_PACK_START     0xBA
+#define PS_END_CODE       0xB9
+#define PS_SYSTEM_HEADER  0xBB
+#define PS_STREAM_MAP     0xBC
+#define PS_PADDING_STREAM 0xBE
+
+/* CRC-32/MPEG-2, as used by PSI sections. */
+static uint32_t demuxfiltercrc(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < size; i++) {
+        crc ^= (uint32_t) data[i] << 24;
+
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+
+    return crc;
+}
+
+/*
+ * Find the PSI section starting in a TS packet, if it is contained in
+ * it entirely. Returns NULL otherwise.
+ */
+static uint8_t *demuxfiltersection(uint8_t *p, int *length)
+{
+    uint8_t *end = p + TS_PACKET_SIZE;
+    int afc      = (p[3] >> 4) & 3;
+
+    /* Only sections starting at the start of the payload are handled. */
+    if (!(p[1] & 0x40) || !(afc & 1))
+        return NULL;
+
+    uint8_t *payload = p + 4;
+    if (afc & 2)
+        payload += 1 + payload[0];
+
+    if (payload >= end)
+        return NULL;
+
+    uint8_t *s = payload + 1 + payload[0];
+    if (s + 3 > end)
+        return NULL;
+
+    *length = 3 + (((s[1] & 0x0F) << 8) | s[2]);
+    if (*length < 16 || s + *length > end)
+        return NULL;
+
+    return s;
+}
+
+/* Remember the PMT PIDs of every program in a PAT. */
+static void demuxfilterpat(demuxfilter *df, uint8_t *p)
+{
+    int length;
+    uint8_t *s = demuxfiltersection(p, &length);
+    if (!s || s[0] != 0x00)
+        return;
+
+    for (int i = 8; i + 4 <= length - 4; i += 4) {
+        int program = (s[i] << 8) | s[i + 1];
+        int pid     = ((s[i + 2] & 0x1F) << 8) | s[i + 3];
+
+        if (program && std::find(df->pmt_pids.begin(), df->pmt_pids.end(), pid) == df->pmt_pids.end())
+            df->pmt_pids.push_back(pid);
+    }
+}
+
+/*
+ * Drop every elementary stream but ours from a PMT, so libavformat doesn't
+ * create streams for them, and then wait for their parameters.
+ */
+static void demuxfilterpmt(demuxfilter *df, uint8_t *p)
+{
+    int length;
+    uint8_t *s = demuxfiltersection(p, &length);
+    if (!s || s[0] != 0x02)
+        return;
+
+    int info_length = ((s[10] & 0x0F) << 8) | s[11];
+    uint8_t *es     = s + 12 + info_length;
+    uint8_t *es_end = s + length - 4;
+    uint8_t *out    = es;
+
+    while (es + 5 <= es_end) {
+        int pid       = ((es[1] & 0x1F) << 8) | es[2];
+        int es_length = 5 + (((es[3] & 0x0F) << 8) | es[4]);
+
+        if (es + es_length > es_end)
+            return;
+
+        if (pid == df->ts_pid) {
+            memmove(out, es, es_length);
+            out += es_length;
+        }
+
+        es += es_length;
+    }
+
+    if (out == es_end)
+        return;
+
+    int section_length = (int) (out + 4 - (s + 3));
+    s[1] = (s[1] & 0xF0) | ((section_length >> 8) & 0x0F);
+    s[2] = section_length & 0xFF;
+
+    uint32_t crc = demuxfiltercrc(s, out - s);
+    out[0] = (crc >> 24) & 0xFF;
+    out[1] = (crc >> 16) & 0xFF;
+    out[2] = (crc >> 8) & 0xFF;
+    out[3] = crc & 0xFF;
+
+    memset(out + 4, 0xFF, p + TS_PACKET_SIZE - (out + 4));
+}
+
+static void demuxfilterpacket(demuxfilter *df, uint8_t *p)
+{
+    int pid = ((p[1] & 0x1F) << 8) | p[2];
+
+    if (pid == df->ts_pid)
+        return;
+
+    if (pid == 0x0000) {
+        demuxfilterpat(df, p);
+        return;
+    }
+
+    if (std::find(df->pmt_pids.begin(), df->pmt_pids.end(), pid) != df->pmt_pids.end()) {
+        demuxfilterpmt(df, p);
+        return;
+    }
+
+    /* Anything else becomes a null packet, which is dropped right away. */
+    p[1] = 0x1F;
+    p[2] = 0xFF;
+}
+
+static int demuxfilterts(demuxfilter *df, uint8_t *buf, int size, int max_keep)
+{
+    int i = 0;
+
+    while (i < size) {
+        if (df->skip > 0) {
+            int n     = (int) std::min<int64_t>(df->skip, size - i);
+            i        += n;
+            df->skip -= n;
+            continue;
+        }
+
+        /* Find a sync byte, followed by another one a packet later. */
+        if (df->skip < 0) {
+            while (i < size && !(buf[i] == 0x47 && (i + TS_PACKET_SIZE >= size || buf[i + TS_PACKET_SIZE] == 0x47)))
+                i++;
+
+            if (i == size)
+                break;
+
+            df->skip = 0;
+        }
+
+        if (size - i < TS_PACKET_SIZE) {
+            /* Have the rest of it read again, if possible, so it can be rewritten whole. */
+            if (size - i <= max_keep)
+                return size - i;
+
+            df->skip = TS_PACKET_SIZE - (size - i);
+            break;
+        }
+
+        if (buf[i] != 0x47) {
+            df->skip = -1;
+            continue;
+        }
+
+        demuxfilterpacket(df, buf + i);
+        i += TS_PACKET_SIZE;
+    }
+
+    return 0;
+}
+
+static int demuxfilterps(demuxfilter *df, uint8_t *buf, int size, int max_keep)
+{
+    int i = 0;
+
+    while (i < size) {
+        if (df->skip > 0) {
+            int n     = (int) std::min<int64_t>(df->skip, size - i);
+            i        += n;
+            df->skip -= n;
+            continue;
+        }
+
+        /* Only a pack start is trusted to get back in sync. */
+        if (df->skip < 0) {
+            while (i + 3 < size && !(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1 && buf[i + 3] == PS_PACK_START))
+                i++;
+
+            if (i + 3 >= size)
+                break;
+
+            df->skip = 0;
+        }
+
+        /* Enough for any header we parse. */
+        if (size - i < 14) {
+            if (size - i <= max_keep)
+                return size - i;
+
+            df->skip = -1;
+            break;
+        }
+
+        if (buf[i] || buf[i + 1] || buf[i + 2] != 1) {
+            df->skip = -1;
+            continue;
+        }
+
+        int id = buf[i + 3];
+
+        if (id == PS_PACK_START) {
+            /* MPEG-2 pack headers have stuffing, MPEG-1 ones don't. */
+            if ((buf[i + 4] & 0xC0) == 0x40)
+                df->skip = 14 + (buf[i + 13] & 7);
+            else
+                df->skip = 12;
+        } else if (id == PS_END_CODE) {
+            df->skip = 4;
+        } else if (id >= PS_SYSTEM_HEADER) {
+            df->skip = 6 + ((buf[i + 4] << 8) | buf[i + 5]);
+
+            bool video = id >= 0xE0 && id <= 0xEF;
+            if (!video && id != PS_SYSTEM_HEADER && id != PS_STREAM_MAP)
+                buf[i + 3] = PS_PADDING_STREAM;
+        } else {
+            df->skip = -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Start over, e.g. after a seek. Known PMT PIDs are kept. */
+void demuxfilterreset(demuxfilter *df, enum streamtype stream_type, int ts_pid)
+{
+    if (df->stream_type != stream_type || df->ts_pid != ts_pid)
+        df->pmt_pids.clear();
+
+    df->stream_type = stream_type;
+    df->ts_pid      = ts_pid;
+    df->skip        = -1;
+}
+
+/*
+ * Filter a buffer of stream data in place. Returns the number of bytes at
+ * the end, up to max_keep, that should be read again with the next buffer,
+ * because they hold an incomplete header.
+ */
+int demuxfilterrun(demuxfilter *df, uint8_t *buf, int size, int max_keep)
+{
+    if (df->stream_type == TRANSPORT)
+        return demuxfilterts(df, buf, size, max_keep);
+    else if (df->stream_type == PROGRAM)
+        return demuxfilterps(df, buf, size, max_keep);
+
+    return 0;
+}
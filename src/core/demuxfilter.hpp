@@ -0,0 +1,52 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef DEMUXFILTER_H
+#define DEMUXFILTER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "d2v.hpp"
+
+#define TS_PACKET_SIZE 188
+
+/*
+ * Rewrites the raw stream, as it is read, so libavformat never sees the
+ * streams we don't decode, without changing any byte offsets:
+ *
+ *   - In transport streams, packets of other PIDs become null packets, and
+ *     PMTs only list our PID. PATs are kept, to find the PMTs.
+ *   - In program streams, PES packets other than video become padding.
+ */
+typedef struct demuxfilter {
+    enum streamtype stream_type;
+    int ts_pid;
+
+    int64_t skip; // Bytes until the next packet header, or -1 if not in sync.
+    std::vector<int> pmt_pids;
+} demuxfilter;
+
+void demuxfilterreset(demuxfilter *df, enum streamtype stream_type, int ts_pid);
+int demuxfilterrun(demuxfilter *df, uint8_t *buf, int size, int max_keep);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "diskcache.hpp"
+
+namespace fs = std::filesystem;
+
+#define DISKCACHE_VERSION 1
+
+typedef struct diskcacheheader {
+    char magic[4];
+    uint32_t version;
+    int32_t num_planes;
+    int32_t pict_type;
+    int32_t row_size[DISKCACHE_MAX_PLANES];
+    int32_t height[DISKCACHE_MAX_PLANES];
+    int64_t packed_size[DISKCACHE_MAX_PLANES]; // Equal to row_size * height if stored uncompressed.
+} diskcacheheader;
+
+static FILE *diskcacheopen(const fs::path& path, bool write)
+{
+#ifdef _WIN32
+    return _wfopen(path.c_str(), write ? L"wb" : L"rb");
+#else
+    return fopen(path.c_str(), write ? "wb" : "rb");
+#endif
+}
+
+static fs::path diskcachepath(const diskcache *dc, int frame)
+{
+    return dc->dir / (std::to_string(frame) + ".d2vf");
+}
+
+/* Total size of the cached frames, and optionally a list of them. */
+static int64_t diskcachescan(const diskcache *dc, std::vector<std::pair<fs::file_time_type, fs::path>> *files)
+{
+    std::error_code ec;
+    int64_t size = 0;
+
+    for (const fs::directory_entry& e : fs::directory_iterator(dc->dir, ec)) {
+        if (e.path().extension() != ".d2vf")
+            continue;
+
+        uintmax_t file_size = e.file_size(ec);
+        if (ec)
+            continue;
+
+        size += (int64_t) file_size;
+
+        if (files)
+            files->emplace_back(e.last_write_time(ec), e.path());
+    }
+
+    return size;
+}
+
+diskcache *diskcacheinit(const char *root, uint64_t key, int64_t max_size, std::string& err)
+{
+    std::unique_ptr<diskcache> ret(new diskcache());
+    std::error_code ec;
+    char name[17];
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+
+    ret->dir      = fs::u8path(root) / name;
+    ret->max_size = max_size;
+
+    fs::create_directories(ret->dir, ec);
+    if (ec) {
+        err  = "Cannot create cache directory: ";
+        err += ret->dir.u8string();
+        return NULL;
+    }
+
+    ret->size = diskcachescan(ret.get(), NULL);
+
+    return ret.release();
+}
+
+/*
+ * Read a frame from the cache. Returns false if it isn't there, is
+ * damaged, or doesn't match the requested geometry.
+ */
+bool diskcacheread(diskcache *dc, int frame, diskcacheframe *f)
+{
+    fs::path path = diskcachepath(dc, frame);
+    diskcacheheader h;
+
+    FILE *in = diskcacheopen(path, false);
+    if (!in)
+        return false;
+
+    std::unique_ptr<FILE, int (*)(FILE *)> closer(in, fclose);
+
+    if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, "D2VF", 4) || h.version != DISKCACHE_VERSION ||
+        h.num_planes != f->num_planes)
+        return false;
+
+    /*
+     * The file may be truncated or damaged, so every plane must fit what
+     * it can decompress to, and the planes must add up to the file.
+     */
+    int64_t total_size = (int64_t) sizeof(h);
+
+    for (int i = 0; i < f->num_planes; i++) {
+        if (h.row_size[i] != f->row_size[i] || h.height[i] != f->height[i])
+            return false;
+
+        int64_t raw_size = (int64_t) h.row_size[i] * h.height[i];
+        if (raw_size <= 0 || raw_size > INT_MAX)
+            return false;
+
+#ifdef HAVE_LZ4
+        int64_t max_packed = LZ4_compressBound((int) raw_size);
+#else
+        int64_t max_packed = raw_size;
+#endif
+        if (h.packed_size[i] <= 0 || h.packed_size[i] > max_packed)
+            return false;
+
+        total_size += h.packed_size[i];
+    }
+
+    std::error_code ec;
+    uintmax_t file_size = fs::file_size(path, ec);
+    if (ec || file_size != (uintmax_t) total_size)
+        return false;
+
+    for (int i = 0; i < f->num_planes; i++) {
+        int64_t raw_size = (int64_t) h.row_size[i] * h.height[i];
+
+        dc->buf.resize((size_t) std::max(raw_size, h.packed_size[i]));
+        if (fread(dc->buf.data(), 1, (size_t) h.packed_size[i], in) != (size_t) h.packed_size[i])
+            return false;
+
+        const uint8_t *src = dc->buf.data();
+
+        if (h.packed_size[i] != raw_size) {
+#ifdef HAVE_LZ4
+            dc->raw.resize((size_t) raw_size);
+            if (LZ4_decompress_safe((const char *) src, (char *) dc->raw.data(), (int) h.packed_size[i], (int) raw_size) != raw_size)
+                return false;
+            src = dc->raw.data();
+#else
+            return false;
+#endif
+        }
+
+        for (int y = 0; y < f->height[i]; y++)
+            memcpy(f->data[i] + y * f->stride[i], src + (int64_t) y * f->row_size[i], f->row_size[i]);
+    }
+
+    f->pict_type = h.pict_type;
+
+    /* Mark it as recently used. */
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+    return true;
+}
+
+/* Delete the least recently used frames until the cache is back under 90% of its size. */
+static void diskcacheevict(diskcache *dc)
+{
+    std::vector<std::pair<fs::file_time_type, fs::path>> files;
+    std::error_code ec;
+
+    /* Other processes may share the directory, so look at what's really there. */
+    dc->size = diskcachescan(dc, &files);
+    std::sort(files.begin(), files.end());
+
+    for (size_t i = 0; i < files.size() && dc->size > dc->max_size / 10 * 9; i++) {
+        uintmax_t file_size = fs::file_size(files[i].second, ec);
+        if (!ec && fs::remove(files[i].second, ec))
+            dc->size -= (int64_t) file_size;
+    }
+}
+
+/*
+ * Store a frame in the cache. It is written to a temporary file first,
+ * so readers never see a partial frame. Errors are ignored, since the
+ * frame can always be decoded again.
+ */
+void diskcachewrite(diskcache *dc, int frame, const diskcacheframe *f)
+{
+    diskcacheheader h = {};
+    std::vector<uint8_t> packed[DISKCACHE_MAX_PLANES];
+
+    memcpy(h.magic, "D2VF", 4);
+    h.version    = DISKCACHE_VERSION;
+    h.num_planes = f->num_planes;
+    h.pict_type  = f->pict_type;
+
+    for (int i = 0; i < f->num_planes; i++) {
+        int64_t raw_size = (int64_t) f->row_size[i] * f->height[i];
+
+        dc->buf.resize((size_t) raw_size);
+        for (int y = 0; y < f->height[i]; y++)
+            memcpy(dc->buf.data() + (int64_t) y * f->row_size[i], f->data[i] + y * f->stride[i], f->row_size[i]);
+
+        h.row_size[i] = f->row_size[i];
+        h.height[i]   = f->height[i];
+
+#ifdef HAVE_LZ4
+        packed[i].resize((size_t) LZ4_compressBound((int) raw_size));
+        int packed_size = LZ4_compress_default((const char *) dc->buf.data(), (char *) packed[i].data(),
+                                               (int) raw_size, (int) packed[i].size());
+
+        /* Store it as is if it doesn't compress. */
+        if (packed_size > 0 && packed_size < raw_size) {
+            packed[i].resize((size_t) packed_size);
+            h.packed_size[i] = packed_size;
+            continue;
+        }
+#endif
+
+        packed[i].assign(dc->buf.begin(), dc->buf.end());
+        h.packed_size[i] = raw_size;
+    }
+
+    std::random_device rd;
+    fs::path path = diskcachepath(dc, frame);
+    fs::path tmp  = path;
+    tmp += "." + std::to_string(rd()) + ".tmp";
+
+    FILE *out = diskcacheopen(tmp, true);
+    if (!out)
+        return;
+
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+    for (int i = 0; i < f->num_planes && ok; i++)
+        ok = fwrite(packed[i].data(), 1, packed[i].size(), out) == packed[i].size();
+
+    ok = !fclose(out) && ok;
+
+    /* A frame written by another source with the same key is replaced. */
+    std::error_code ec;
+    uintmax_t replaced = fs::file_size(path, ec);
+    if (ec)
+        replaced = 0;
+
+    if (ok)
+        fs::rename(tmp, path, ec);
+
+    if (!ok || ec) {
+        fs::remove(tmp, ec);
+        return;
+    }
+
+    dc->size -= (int64_t) replaced;
+    dc->size += (int64_t) sizeof(h);
+    for (int i = 0; i < f->num_planes; i++)
+        dc->size += h.packed_size[i];
+
+    if (dc->size > dc->max_size)
+        diskcacheevict(dc);
+}
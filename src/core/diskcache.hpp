@@ -0,0 +1,65 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#define DISKCACHE_MAX_PLANES 3
+
+/*
+ * One decoded frame, as stored in the disk cache. The caller owns
+ * the plane buffers, whose geometry must match the cached frame's.
+ */
+typedef struct diskcacheframe {
+    int num_planes;
+    int pict_type;
+    uint8_t *data[DISKCACHE_MAX_PLANES];
+    ptrdiff_t stride[DISKCACHE_MAX_PLANES];
+    int row_size[DISKCACHE_MAX_PLANES]; // In bytes.
+    int height[DISKCACHE_MAX_PLANES];
+} diskcacheframe;
+
+/*
+ * A directory of decoded frames, one file per frame, shared by every
+ * source with the same key. Once it grows past max_size, the least
+ * recently used frames are deleted.
+ */
+typedef struct diskcache {
+    std::filesystem::path dir;
+    int64_t max_size;
+    int64_t size;
+
+    std::vector<uint8_t> buf; // Scratch space for (de)compression.
+    std::vector<uint8_t> raw; // Decompressed plane, when reading.
+} diskcache;
+
+diskcache *diskcacheinit(const char *root, uint64_t key, int64_t max_size, std::string& err);
+bool diskcacheread(diskcache *dc, int frame, diskcacheframe *f);
+void diskcachewrite(diskcache *dc, int frame, const diskcacheframe *f);
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "compat.hpp"
+#include "filecache.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/* Every open source file, by name, for as long as any filecache uses it. */
+static std::mutex shared_files_lock;
+static std::map<std::string, std::weak_ptr<sharedfile>> shared_files;
+
+sharedfile::~sharedfile()
+{
+#ifdef _WIN32
+    CloseHandle((HANDLE) handle);
+#else
+    close(fd);
+#endif
+}
+
+/* Open a file, or get the already open one. Returns an empty pointer on error. */
+static std::shared_ptr<sharedfile> sharedfileopen(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(shared_files_lock);
+
+    std::weak_ptr<sharedfile>& entry = shared_files[name];
+
+    std::shared_ptr<sharedfile> ret = entry.lock();
+    if (ret)
+        return ret;
+
+#ifdef _WIN32
+    wchar_t filename[_MAX_PATH];
+
+    if (!MultiByteToWideChar(CP_UTF8, 0, name.c_str(), -1, filename, ARRAYSIZE(filename)))
+        return ret;
+
+    /* Allow for the file still being written. */
+    HANDLE handle = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return ret;
+
+    ret.reset(new sharedfile());
+    ret->handle = (void *) handle;
+#else
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ret;
+
+    ret.reset(new sharedfile());
+    ret->fd = fd;
+#endif
+
+    entry = ret;
+
+    return ret;
+}
+
+/*
+ * Read up to size bytes at pos, without touching any file position.
+ * Returns the number of bytes read, which is only short at the end
+ * of the file, or -1 on error.
+ */
+static int64_t sharedfileread(const sharedfile *f, int64_t pos, uint8_t *buf, int64_t size)
+{
+    int64_t total = 0;
+
+    while (total < size) {
+#ifdef _WIN32
+        OVERLAPPED ov = {};
+        ov.Offset     = (DWORD) (pos + total);
+        ov.OffsetHigh = (DWORD) ((pos + total) >> 32);
+
+        DWORD got = 0;
+        if (!ReadFile((HANDLE) f->handle, buf + total, (DWORD) std::min<int64_t>(size - total, 1 << 30), &got, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            return -1;
+        }
+#else
+        ssize_t got = pread(f->fd, buf + total, (size_t) (size - total), (off_t) (pos + total));
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+#endif
+
+        if (!got)
+            break;
+
+        total += got;
+    }
+
+    return total;
+}
+
+/* Get the size of a file, without opening it. Returns -1 on error. */
+static int64_t filecachestat(const std::string& name)
+{
+#ifdef _WIN32
+    wchar_t filename[_MAX_PATH];
+    struct _stat64 st;
+
+    if (!MultiByteToWideChar(CP_UTF8, 0, name.c_str(), -1, filename, ARRAYSIZE(filename)))
+        return -1;
+
+    if (_wstat64(filename, &st))
+        return -1;
+#else
+    struct stat st;
+
+    if (stat(name.c_str(), &st))
+        return -1;
+#endif
+
+    return (int64_t) st.st_size;
+}
+
+/* Lay the files out one after another, in the virtual file. */
+static void filecachelayout(filecache *fc)
+{
+    fc->starts.resize(fc->sizes.size() + 1);
+    fc->starts[0] = 0;
+
+    for (size_t i = 0; i < fc->sizes.size(); i++)
+        fc->starts[i + 1] = fc->starts[i] + fc->sizes[i];
+}
+
+/* Get the size of every file, without opening any of them. */
+filecache *filecacheinit(const std::vector<std::string>& names, std::string& err)
+{
+    std::unique_ptr<filecache> ret(new filecache());
+
+    ret->names = names;
+    ret->handles.resize(names.size());
+    ret->last_used.resize(names.size(), 0);
+    ret->dropped.resize(names.size(), 0);
+
+    for (size_t i = 0; i < names.size(); i++) {
+        int64_t size = filecachestat(names[i]);
+
+        if (size < 0) {
+            err  = "Cannot open file: ";
+            err += names[i];
+            return NULL;
+        }
+
+        ret->sizes.push_back(size);
+    }
+
+    filecachelayout(ret.get());
+
+    return ret.release();
+}
+
+/* Refresh the sizes of files which may still be growing. */
+bool filecacheupdate(filecache *fc, std::string& err)
+{
+    for (size_t i = 0; i < fc->names.size(); i++) {
+        int64_t size = filecachestat(fc->names[i]);
+
+        if (size < 0) {
+            err  = "Cannot open file: ";
+            err += fc->names[i];
+            return false;
+        }
+
+        fc->sizes[i] = size;
+    }
+
+    filecachelayout(fc);
+
+    return true;
+}
+
+/*
+ * Pass an access pattern hint for part of a file to the kernel, where
+ * supported. A size of 0 means until the end of the file.
+ */
+static void filecacheadvise(const sharedfile *f, int64_t pos, int64_t size, int advice)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(f->fd, (off_t) pos, (off_t) size, advice);
+#endif
+}
+
+/* Get an open handle for a file, releasing the least recently used one if needed. */
+static sharedfile *filecacheget(filecache *fc, int file)
+{
+    fc->last_used[file] = ++fc->use_count;
+
+    if (fc->handles[file])
+        return fc->handles[file].get();
+
+    if (fc->open.size() >= FILECACHE_MAX_OPEN) {
+        size_t lru = 0;
+
+        for (size_t i = 1; i < fc->open.size(); i++)
+            if (fc->last_used[fc->open[i]] < fc->last_used[fc->open[lru]])
+                lru = i;
+
+        fc->handles[fc->open[lru]].reset();
+        fc->open.erase(fc->open.begin() + lru);
+    }
+
+    std::shared_ptr<sharedfile> f = sharedfileopen(fc->names[file]);
+    if (!f)
+        return NULL;
+
+    fc->handles[file] = f;
+    fc->dropped[file] = 0;
+    fc->open.push_back(file);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* Most reads are linear, so ask for more readahead. */
+    if (fc->hints)
+        filecacheadvise(f.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    return f.get();
+}
+
+/*
+ * Read up to size bytes at pos from a file. Returns -1 if the file
+ * can't be opened or read.
+ */
+int64_t filecacheread(filecache *fc, int file, int64_t pos, uint8_t *buf, int64_t size)
+{
+    sharedfile *in = filecacheget(fc, file);
+    if (!in)
+        return -1;
+
+    int64_t ret = sharedfileread(in, pos, buf, size);
+    if (ret < 0)
+        return -1;
+
+#ifdef POSIX_FADV_DONTNEED
+    /*
+     * Drop what we've read linearly from the page cache, except for the
+     * last FILECACHE_DROP_BEHIND bytes, so reading through a large file
+     * doesn't evict everything else. Dropping is done in large chunks,
+     * to keep the number of calls down.
+     */
+    if (fc->hints) {
+        int64_t end = pos + ret - FILECACHE_DROP_BEHIND;
+
+        if (pos < fc->dropped[file]) {
+            fc->dropped[file] = pos;
+        } else if (end - fc->dropped[file] >= FILECACHE_DROP_BEHIND) {
+            filecacheadvise(in, fc->dropped[file], end - fc->dropped[file], POSIX_FADV_DONTNEED);
+            fc->dropped[file] = end;
+        }
+    }
+#endif
+
+    return ret;
+}
+
+/*
+ * Ask the kernel to start reading part of a file in the background,
+ * before a seek to it, if I/O hints are enabled.
+ */
+void filecacheprefetch(filecache *fc, int file, int64_t pos, int64_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (!fc->hints)
+        return;
+
+    sharedfile *in = filecacheget(fc, file);
+    if (!in)
+        return;
+
+    filecacheadvise(in, pos, size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Find the file an offset in the virtual file is in. Empty files are
+ * skipped, and offsets past the end are in the last file.
+ */
+int filecachefind(const filecache *fc, int64_t offset)
+{
+    auto end = fc->starts.end() - 1;
+    auto it  = std::upper_bound(fc->starts.begin(), end, offset);
+
+    return std::max((int) (it - fc->starts.begin()) - 1, 0);
+}
+
+/*
+ * Read up to size bytes at offset in the virtual file, across as many
+ * files as it takes. Returns -1 if nothing could be read because a file
+ * can't be opened.
+ */
+int64_t filecachereadat(filecache *fc, int64_t offset, uint8_t *buf, int64_t size)
+{
+    int64_t total = 0;
+
+    for (int file = filecachefind(fc, offset); size > 0 && file < (int) fc->sizes.size(); file++) {
+        int64_t pos  = offset - fc->starts[file];
+        int64_t want = std::min(size, fc->sizes[file] - pos);
+
+        if (want <= 0)
+            continue;
+
+        int64_t ret = filecacheread(fc, file, pos, buf, want);
+        if (ret < 0)
+            return total ? total : -1;
+
+        total  += ret;
+        offset += ret;
+        buf    += ret;
+        size   -= ret;
+
+        /* The file is shorter than it used to be. */
+        if (ret < want)
+            break;
+    }
+
+    return total;
+}
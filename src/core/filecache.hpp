@@ -0,0 +1,90 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Maximum number of source files kept open at once. */
+#define FILECACHE_MAX_OPEN 8
+
+/* With I/O hints, bytes read linearly that are kept in the page cache behind the read position. */
+#define FILECACHE_DROP_BEHIND (16 << 20)
+
+/* With I/O hints, most bytes to ask the kernel to read ahead of a seek. */
+#define FILECACHE_PREFETCH_MAX (16 << 20)
+
+/*
+ * An open source file, shared by every filecache reading it, and closed
+ * once none of them use it anymore. All reads say where to read from, so
+ * there is no file position, and any number of threads can read at once.
+ */
+typedef struct sharedfile {
+#ifdef _WIN32
+    void *handle;
+#else
+    int fd;
+#endif
+
+    ~sharedfile();
+} sharedfile;
+
+/*
+ * The set of source files listed in a D2V. Sizes are known up front,
+ * but files are only opened once they're read from, and the least
+ * recently used ones are released again to stay under FILECACHE_MAX_OPEN.
+ * Files already opened by another filecache are shared with it.
+ *
+ * The files can also be read as one virtual file, in which each file
+ * starts where the previous one ends.
+ */
+typedef struct filecache {
+    std::vector<std::string> names;
+    std::vector<int64_t> sizes;
+    std::vector<int64_t> starts;     // Offset of each file in the virtual file, plus its total size.
+
+    std::vector<std::shared_ptr<sharedfile>> handles; // Empty if not open.
+    std::vector<uint64_t> last_used;
+    std::vector<int> open;           // Indices of the open files.
+    uint64_t use_count;
+
+    /*
+     * Whether to give the kernel hints about our access pattern, and how
+     * far the pages read from each file have been dropped from its cache.
+     */
+    bool hints;
+    std::vector<int64_t> dropped;
+} filecache;
+
+filecache *filecacheinit(const std::vector<std::string>& names, std::string& err);
+bool filecacheupdate(filecache *fc, std::string& err);
+int64_t filecacheread(filecache *fc, int file, int64_t pos, uint8_t *buf, int64_t size);
+void filecacheprefetch(filecache *fc, int file, int64_t pos, int64_t size);
+int filecachefind(const filecache *fc, int64_t offset);
+int64_t filecachereadat(filecache *fc, int64_t offset, uint8_t *buf, int64_t size);
+
+#endif
@@ -49,6 +49,7 @@ typedef struct gop {
     int skip;
     int vob;
     int cell;
+    int segment;
     std::vector<uint8_t> flags;
 } gop;
 
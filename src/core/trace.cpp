@@ -0,0 +1,234 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "trace.hpp"
+
+/* Number of spans kept per thread. */
+#define TRACE_RING_SIZE 16384
+
+typedef struct traceevent {
+    const char *name;
+    int64_t start;
+    int64_t duration;
+    int num_args;
+    const char *arg_names[TRACE_MAX_ARGS];
+    int64_t arg_values[TRACE_MAX_ARGS];
+} traceevent;
+
+/*
+ * The lock is only ever contended while the trace is written out,
+ * which must not happen while the owning thread is adding a span.
+ */
+typedef struct tracering {
+    int tid;
+    std::mutex lock;
+    uint64_t written;
+    std::vector<traceevent> events;
+} tracering;
+
+static std::mutex trace_lock;
+static std::atomic<bool> trace_enabled(false);
+static int trace_users;
+static std::filesystem::path trace_path;
+
+static FILE *traceopen(const std::filesystem::path& path)
+{
+#ifdef _WIN32
+    return _wfopen(path.c_str(), L"wb");
+#else
+    return fopen(path.c_str(), "wb");
+#endif
+}
+
+/*
+ * Rings are never freed once a thread has one, since the thread
+ * may still hold a pointer to it after the trace is written.
+ */
+static std::vector<std::unique_ptr<tracering>> trace_rings;
+static thread_local tracering *trace_ring;
+
+static tracering *tracegetring(void)
+{
+    if (trace_ring)
+        return trace_ring;
+
+    std::unique_ptr<tracering> ring(new tracering());
+    ring->written = 0;
+    ring->events.resize(TRACE_RING_SIZE);
+
+    std::lock_guard<std::mutex> lock(trace_lock);
+
+    ring->tid  = (int) trace_rings.size() + 1;
+    trace_ring = ring.get();
+    trace_rings.push_back(std::move(ring));
+
+    return trace_ring;
+}
+
+tracespan::tracespan(const char *span_name)
+{
+    name     = span_name;
+    num_args = 0;
+    start    = trace_enabled.load(std::memory_order_relaxed) ? av_gettime_relative() : -1;
+}
+
+tracespan::~tracespan()
+{
+    end();
+}
+
+/* Record the span now, rather than when it goes out of scope. */
+void tracespan::end(void)
+{
+    if (start < 0 || !trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    tracering *ring = tracegetring();
+
+    /* Tracing may have been stopped, and the ring written out, in the meantime. */
+    std::lock_guard<std::mutex> lock(ring->lock);
+    if (!trace_enabled.load(std::memory_order_relaxed)) {
+        start = -1;
+        return;
+    }
+
+    traceevent& ev = ring->events[ring->written % TRACE_RING_SIZE];
+
+    ev.name     = name;
+    ev.start    = start;
+    ev.duration = av_gettime_relative() - start;
+    ev.num_args = num_args;
+    for (int i = 0; i < num_args; i++) {
+        ev.arg_names[i]  = arg_names[i];
+        ev.arg_values[i] = arg_values[i];
+    }
+
+    ring->written++;
+
+    start = -1;
+}
+
+void tracespan::arg(const char *arg_name, int64_t value)
+{
+    if (start < 0 || num_args == TRACE_MAX_ARGS)
+        return;
+
+    arg_names[num_args]  = arg_name;
+    arg_values[num_args] = value;
+    num_args++;
+}
+
+/*
+ * Start tracing to the given file. Tracing is shared by everyone who
+ * starts it, and the first path given is the one that is written to.
+ */
+bool tracestart(const char *path, std::string& err)
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+
+    if (!trace_users) {
+        std::filesystem::path fspath = std::filesystem::u8path(path);
+
+        /* Make sure we can actually write the trace before recording anything. */
+        FILE *out = traceopen(fspath);
+        if (!out) {
+            err  = "Cannot open trace file: ";
+            err += path;
+            return false;
+        }
+        fclose(out);
+
+        trace_path = fspath;
+        trace_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    trace_users++;
+
+    return true;
+}
+
+/* Stop tracing, and write out all recorded spans if we were the last user. */
+void tracestop(void)
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+
+    if (!trace_users || --trace_users)
+        return;
+
+    /*
+     * Spans still being added finish before their ring is locked below,
+     * and later ones see that tracing is off once they have the lock.
+     */
+    trace_enabled.store(false, std::memory_order_relaxed);
+
+    FILE *out = traceopen(trace_path);
+    if (!out) {
+        for (size_t i = 0; i < trace_rings.size(); i++) {
+            std::lock_guard<std::mutex> ring_lock(trace_rings[i]->lock);
+            trace_rings[i]->written = 0;
+        }
+        return;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+
+    bool first = true;
+    for (size_t i = 0; i < trace_rings.size(); i++) {
+        tracering *ring = trace_rings[i].get();
+        std::lock_guard<std::mutex> ring_lock(ring->lock);
+
+        uint64_t end   = ring->written;
+        uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+
+        for (uint64_t j = begin; j < end; j++) {
+            const traceevent& ev = ring->events[j % TRACE_RING_SIZE];
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{",
+                    first ? "" : ",", ev.name, ring->tid, (long long) ev.start, (long long) ev.duration);
+
+            for (int k = 0; k < ev.num_args; k++)
+                fprintf(out, "%s\"%s\":%lld", k ? "," : "", ev.arg_names[k], (long long) ev.arg_values[k]);
+
+            fprintf(out, "}}");
+            first = false;
+        }
+
+        ring->written = 0;
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
@@ -0,0 +1,54 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Optional Chrome/Perfetto trace-event recording. Spans are stored in
+ * a fixed-size ring buffer per thread, so only the most recent ones are
+ * kept, and are written out as JSON once the last user stops tracing.
+ */
+
+#define TRACE_MAX_ARGS 4
+
+typedef struct tracespan {
+    const char *name;
+    int64_t start;
+    int num_args;
+    const char *arg_names[TRACE_MAX_ARGS];
+    int64_t arg_values[TRACE_MAX_ARGS];
+
+    tracespan(const char *span_name);
+    ~tracespan();
+    void arg(const char *arg_name, int64_t value);
+    void end(void);
+} tracespan;
+
+bool tracestart(const char *path, std::string& err);
+void tracestop(void);
+
+#endif
@@ -21,70 +21,88 @@
  */
 
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 
 #include <algorithm>
+#include <filesystem>
 
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
 
 #include "applyrff4.hpp"
 #include "d2v.hpp"
+#include "d2vsource4.hpp"
 #include "gop.hpp"
+#include "trace.hpp"
 
 namespace vs4 {
 
-static const VSFrame *VS_CC rffGetFrame(int n, int activationReason, void *instanceData, void **frameData,
-                                    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+/* Longest cadence period, in source frames, that we look for. */
+#define RFF_MAX_PERIOD 8
+
+#define RFF_CODE_RFF         0x01
+#define RFF_CODE_TFF         0x02
+#define RFF_CODE_PROGRESSIVE 0x04
+
+/*
+ * Find the source frame and type of an output field, by looking up
+ * the cadence segment it is in, and indexing into its period.
+ */
+static rffField rffGetField(const rffData *d, int64_t field)
 {
-    const rffData *d = (const rffData *) instanceData;
-    VSFrame *f;
+    auto seg = std::upper_bound(d->segments.begin(), d->segments.end(), field,
+        [](int64_t f, const rffSegment& s) { return f < s.field_start; }) - 1;
 
-    /* What frames to use for fields. */
-    const rffField *top_field = &d->fields[n * 2];
-    const rffField *bottom_field = &d->fields[n * 2 + 1];
-    if (top_field->type == Bottom)
-        std::swap(top_field, bottom_field);
+    int64_t rel    = field - seg->field_start;
+    int64_t period = rel / seg->period_fields;
 
-    int top    = top_field->frame;
-    int bottom = bottom_field->frame;
+    rffField ret = d->patterns[seg->pattern + (size_t) (rel % seg->period_fields)];
+    ret.frame   += seg->frame_start + (int) (period * seg->period_frames);
 
-    bool samefields = top == bottom;
+    return ret;
+}
 
-    /* Request out source frames. */
-    if (activationReason == arInitial) {
-        if (samefields) {
-            vsapi->requestFrameFilter(top, d->node, frameCtx);
-        } else {
-            vsapi->requestFrameFilter(std::min(top, bottom), d->node, frameCtx);
-            vsapi->requestFrameFilter(std::max(top, bottom), d->node, frameCtx);
-        }
-        return NULL;
+static void rffRequestFields(int top, int bottom, VSNode *node, VSFrameContext *frameCtx, const VSAPI *vsapi)
+{
+    if (top == bottom) {
+        vsapi->requestFrameFilter(top, node, frameCtx);
+    } else {
+        vsapi->requestFrameFilter(std::min(top, bottom), node, frameCtx);
+        vsapi->requestFrameFilter(std::max(top, bottom), node, frameCtx);
     }
+}
 
-    /* Check if we're ready yet. */
-    if (activationReason != arAllFramesReady)
-        return NULL;
+/*
+ * Make an output frame from the top field of one source frame, and the
+ * bottom field of another, or return the source frame if they're the same.
+ */
+static VSFrame *rffWeave(int top, int bottom, bool bff, const VSVideoInfo *vi, VSNode *node,
+                         VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    VSFrame *f;
+    bool samefields = top == bottom;
 
     /* Source and destination frames. */
-    const VSFrame *st = vsapi->getFrameFilter(top, d->node, frameCtx);
-    const VSFrame *sb = samefields ? NULL : vsapi->getFrameFilter(bottom, d->node, frameCtx);
+    const VSFrame *st = vsapi->getFrameFilter(top, node, frameCtx);
+    const VSFrame *sb = samefields ? NULL : vsapi->getFrameFilter(bottom, node, frameCtx);
 
     /* Copy into VS's buffers. */
     if (samefields) {
         f = vsapi->copyFrame(st, core);
     } else {
+        tracespan span("weave");
         ptrdiff_t dst_stride[3], srct_stride[3], srcb_stride[3];
 
         /*
          * Copy properties from the first field's source frame.
          * Some of them will be wrong for this frame, but ¯\_(ツ)_/¯.
         */
-        const VSFrame *prop_src = bottom_field < top_field ? sb : st;
+        const VSFrame *prop_src = bff ? sb : st;
 
-        f  = vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, prop_src, core);
+        f  = vsapi->newVideoFrame(&vi->format, vi->width, vi->height, prop_src, core);
 
-        for (int i = 0; i < d->vi.format.numPlanes; i++) {
+        for (int i = 0; i < vi->format.numPlanes; i++) {
             dst_stride[i]  = vsapi->getStride(f, i);
             srct_stride[i] = vsapi->getStride(st, i);
             srcb_stride[i] = vsapi->getStride(sb, i);
@@ -97,11 +115,11 @@ static const VSFrame *VS_CC rffGetFrame(int n, int activationReason, void *insta
 
             vsh::bitblt(dstp, dst_stride[i] * 2,
                       srctp, srct_stride[i] * 2,
-                      width * d->vi.format.bytesPerSample, height / 2);
+                      width * vi->format.bytesPerSample, height / 2);
 
             vsh::bitblt(dstp + dst_stride[i], dst_stride[i] * 2,
                       srcbp + srcb_stride[i], srcb_stride[i] * 2,
-                      width * d->vi.format.bytesPerSample, height / 2);
+                      width * vi->format.bytesPerSample, height / 2);
         }
     }
 
@@ -109,7 +127,7 @@ static const VSFrame *VS_CC rffGetFrame(int n, int activationReason, void *insta
         /* Set field order. */
         VSMap *props = vsapi->getFramePropertiesRW(f);
 
-        vsapi->mapSetInt(props, "_FieldBased", (bottom_field < top_field) ? 1 /* bff */ : 2 /* tff */, maReplace);
+        vsapi->mapSetInt(props, "_FieldBased", bff ? 1 /* bff */ : 2 /* tff */, maReplace);
     }
 
     vsapi->freeFrame(st);
@@ -119,25 +137,284 @@ static const VSFrame *VS_CC rffGetFrame(int n, int activationReason, void *insta
     return f;
 }
 
+static const VSFrame *VS_CC rffGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    const rffData *d = (const rffData *) instanceData;
+
+    /* What frames to use for fields. */
+    rffField top_field    = rffGetField(d, (int64_t) n * 2);
+    rffField bottom_field = rffGetField(d, (int64_t) n * 2 + 1);
+
+    /* Whether the bottom field is displayed first. */
+    bool bff = top_field.type == Bottom;
+    if (bff)
+        std::swap(top_field, bottom_field);
+
+    int top    = top_field.frame;
+    int bottom = bottom_field.frame;
+
+    /* Request out source frames. */
+    if (activationReason == arInitial) {
+        rffRequestFields(top, bottom, d->node, frameCtx, vsapi);
+        return NULL;
+    }
+
+    /* Check if we're ready yet. */
+    if (activationReason != arAllFramesReady)
+        return NULL;
+
+    return rffWeave(top, bottom, bff, &d->vi, d->node, frameCtx, core, vsapi);
+}
+
+/*
+ * Output a single field of a source frame, cropped to our output
+ * dimensions, straight out of its (possibly aligned) buffer.
+ */
+static const VSFrame *VS_CC fieldsGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                       VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    const rffData *d = (const rffData *) instanceData;
+
+    rffField field = rffGetField(d, n);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(field.frame, d->node, frameCtx);
+        return NULL;
+    }
+
+    if (activationReason != arAllFramesReady)
+        return NULL;
+
+    /* Progressive frames have no field order, so just alternate. */
+    bool top = field.type == Top || (field.type == Progressive && !(n & 1));
+
+    tracespan span("fields");
+    const VSFrame *src = vsapi->getFrameFilter(field.frame, d->node, frameCtx);
+    VSFrame *f = vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, src, core);
+
+    for (int i = 0; i < d->vi.format.numPlanes; i++) {
+        ptrdiff_t dst_stride = vsapi->getStride(f, i);
+        ptrdiff_t src_stride = vsapi->getStride(src, i);
+
+        uint8_t *dstp = vsapi->getWritePtr(f, i);
+        const uint8_t *srcp = vsapi->getReadPtr(src, i);
+        int width = vsapi->getFrameWidth(f, i);
+        int height = vsapi->getFrameHeight(f, i);
+
+        vsh::bitblt(dstp, dst_stride,
+                  srcp + (top ? 0 : src_stride), src_stride * 2,
+                  width * d->vi.format.bytesPerSample, height);
+    }
+
+    vsapi->freeFrame(src);
+    span.end();
+
+    VSMap *props = vsapi->getFramePropertiesRW(f);
+
+    vsapi->mapDeleteKey(props, "_FieldBased");
+    vsapi->mapSetInt(props, "_Field", top ? 1 : 0, maReplace);
+    vsapi->mapSetInt(props, "_DurationNum", d->vi.fpsDen, maReplace);
+    vsapi->mapSetInt(props, "_DurationDen", d->vi.fpsNum, maReplace);
+    vsapi->mapSetFloat(props, "_AbsoluteTime",
+        (static_cast<double>(d->vi.fpsDen) * n) / static_cast<double>(d->vi.fpsNum), maReplace);
+
+    return f;
+}
+
+/*
+ * Output a coded progressive frame once, or a pair of matched fields,
+ * with its real duration instead of a constant frame rate.
+ */
+static const VSFrame *VS_CC vfrGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    const vfrData *d = (const vfrData *) instanceData;
+    const vfrFrame& v = d->frames[n];
+
+    if (activationReason == arInitial) {
+        rffRequestFields(v.top, v.bottom, d->node, frameCtx, vsapi);
+        return NULL;
+    }
+
+    if (activationReason != arAllFramesReady)
+        return NULL;
+
+    VSFrame *f = rffWeave(v.top, v.bottom, v.bff, &d->vi, d->node, frameCtx, core, vsapi);
+
+    int64_t duration_num = d->field_num * v.fields;
+    int64_t duration_den = d->field_den;
+    vsh::reduceRational(&duration_num, &duration_den);
+
+    VSMap *props = vsapi->getFramePropertiesRW(f);
+
+    vsapi->mapSetInt(props, "_DurationNum", duration_num, maReplace);
+    vsapi->mapSetInt(props, "_DurationDen", duration_den, maReplace);
+    vsapi->mapSetFloat(props, "_AbsoluteTime",
+        (static_cast<double>(d->field_num) * v.field_start) / static_cast<double>(d->field_den), maReplace);
+
+    return f;
+}
+
+static void VS_CC vfrFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
+{
+    vfrData *d = (vfrData *) instanceData;
+    unregisterStatsNode(d->self);
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
 static void VS_CC rffFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
 {
     rffData *d = (rffData *) instanceData;
+    unregisterStatsNode(d->self);
     vsapi->freeNode(d->node);
     delete d;
 }
 
-VSNode *rffCreate(VSNode *clip, const char *input, VSCore *core, const VSAPI *vsapi)
+/*
+ * Reduce a source frame's flags to the few bits that decide which
+ * output fields it turns into.
+ */
+static uint8_t rffFrameCode(const d2vcontext *d2v, int i, bool apply_rff)
 {
-    std::string msg;
+    frame f  = d2v->frames[i];
+    bool rff = apply_rff && !!(d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_RFF);
+    bool tff = !!(d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_TFF);
+    bool progressive_frame = !!(d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_PROGRESSIVE);
 
-    /* Allocate our private data. */
-    std::unique_ptr<rffData> data(new rffData());
+    bool progressive_sequence = !!(d2v->gops[f.gop].info & GOP_FLAG_PROGRESSIVE_SEQUENCE);
 
-    /* Parse the D2V to get flags. */
-    data->d2v.reset(d2vparse(input, msg));
-    if (!data->d2v) {
-        return NULL;
+    /*
+     * In MPEG2 frame doubling and tripling happens only in progressive sequences.
+     * H264 has no such thing, apparently, but frames still have to be progressive.
+     */
+    if (progressive_sequence ||
+        (progressive_frame && d2v->segments[d2v->gops[f.gop].segment].mpeg_type == 264)) {
+        /* TFF only matters if the frame is repeated. */
+        return RFF_CODE_PROGRESSIVE | (rff ? RFF_CODE_RFF : 0) | (rff && tff ? RFF_CODE_TFF : 0);
+    }
+
+    return (rff ? RFF_CODE_RFF : 0) | (tff ? RFF_CODE_TFF : 0);
+}
+
+/* Append the output fields of a single source frame to our patterns. */
+static void rffAddFrameFields(rffData *d, uint8_t code, int frame)
+{
+    if (code & RFF_CODE_PROGRESSIVE) {
+        /*
+         * We repeat whole frames instead of fields, to turn one
+         * coded progressive frame into either two or three
+         * identical progressive frames.
+         */
+        rffField field;
+        field.frame = frame;
+        field.type  = Progressive;
+
+        int count = 2;
+        if (code & RFF_CODE_RFF)
+            count += (code & RFF_CODE_TFF) ? 4 : 2;
+
+        d->patterns.insert(d->patterns.end(), count, field);
+    } else {
+        /* Repeat fields. */
+        bool tff = !!(code & RFF_CODE_TFF);
+
+        rffField first_field, second_field;
+        first_field.frame = second_field.frame = frame;
+        first_field.type = tff ? Top : Bottom;
+        second_field.type = tff ? Bottom : Top;
+
+        d->patterns.push_back(first_field);
+        d->patterns.push_back(second_field);
+
+        if (code & RFF_CODE_RFF)
+            d->patterns.push_back(first_field);
     }
+}
+
+/* Add a segment of reps repetitions of a period_frames long cadence. */
+static void rffAddSegment(rffData *d, const std::vector<uint8_t>& codes, int start, int period_frames, int reps)
+{
+    rffSegment seg;
+    seg.field_start   = d->num_fields;
+    seg.frame_start   = start;
+    seg.period_frames = period_frames;
+    seg.pattern       = d->patterns.size();
+
+    for (int i = 0; i < period_frames; i++)
+        rffAddFrameFields(d, codes[start + i], i);
+
+    seg.period_fields = (int) (d->patterns.size() - seg.pattern);
+    d->num_fields    += (int64_t) seg.period_fields * reps;
+
+    d->segments.push_back(seg);
+}
+
+/*
+ * Build the field map for all frames of our input clip. If apply_rff is
+ * false, every source frame simply turns into its two fields.
+ */
+static void rffBuildFieldMap(rffData *d, const d2vcontext *d2v, bool apply_rff)
+{
+    int num_frames = d->vi.numFrames;
+
+    std::vector<uint8_t> codes(num_frames);
+    for (int i = 0; i < num_frames; i++)
+        codes[i] = rffFrameCode(d2v, i, apply_rff);
+
+    /*
+     * Split the source frames into runs of repeating cadences, so the
+     * field map only grows with the number of cadence changes. At each
+     * position, pick the period that covers the most frames; frames
+     * which don't repeat at all are gathered into a single segment.
+     */
+    d->num_fields = 0;
+
+    int literal = 0;
+    int i       = 0;
+    while (i < num_frames) {
+        int best_period = 0;
+        int best_reps   = 0;
+
+        for (int p = 1; p <= RFF_MAX_PERIOD && i + 2 * p <= num_frames; p++) {
+            int j = i + p;
+            while (j < num_frames && codes[j] == codes[j - p])
+                j++;
+
+            int reps = (j - i) / p;
+            if (reps >= 2 && reps * p > best_reps * best_period) {
+                best_period = p;
+                best_reps   = reps;
+            }
+        }
+
+        if (!best_period) {
+            literal++;
+            i++;
+            continue;
+        }
+
+        if (literal) {
+            rffAddSegment(d, codes, i - literal, literal, 1);
+            literal = 0;
+        }
+
+        rffAddSegment(d, codes, i, best_period, best_reps);
+        i += best_period * best_reps;
+    }
+
+    if (literal)
+        rffAddSegment(d, codes, num_frames - literal, literal, 1);
+
+    d->segments.shrink_to_fit();
+    d->patterns.shrink_to_fit();
+}
+
+VSNode *rffCreate(VSNode *clip, const d2vcontext *d2v, VSCore *core, const VSAPI *vsapi)
+{
+    /* Allocate our private data. */
+    std::unique_ptr<rffData> data(new rffData());
 
     /* Get our frame info and copy it, so we can modify it after. */
     data->node = vsapi->addNodeRef(clip);
@@ -148,61 +425,193 @@ VSNode *rffCreate(VSNode *clip, const char *input, VSCore *core, const VSAPI *vs
      * with which frames, and out total number of frames after
      * apply the RFF flags.
      */
-    for(int i = 0; i < data->vi.numFrames; i++) {
-        frame f  = data->d2v->frames[i];
-        bool rff = !!(data->d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_RFF);
-        bool tff = !!(data->d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_TFF);
-        bool progressive_frame = !!(data->d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_PROGRESSIVE);
+    rffBuildFieldMap(data.get(), d2v, true);
 
-        bool progressive_sequence = !!(data->d2v->gops[f.gop].info & GOP_FLAG_PROGRESSIVE_SEQUENCE);
+    data->vi.numFrames = (int) (data->num_fields / 2);
 
-        /*
-         * In MPEG2 frame doubling and tripling happens only in progressive sequences.
-         * H264 has no such thing, apparently, but frames still have to be progressive.
-         */
-        if (progressive_sequence ||
-            (progressive_frame && data->d2v->mpeg_type == 264)) {
-            /*
-             * We repeat whole frames instead of fields, to turn one
-             * coded progressive frame into either two or three
-             * identical progressive frames.
-             */
-            rffField field;
-            field.frame = i;
-            field.type = Progressive;
+    VSFilterDependency deps[] = {data->node, rpGeneral};
+    VSNode *out = vsapi->createVideoFilter2("ApplyRFF", &data->vi, rffGetFrame, rffFree, fmParallel, deps, 1, data.get(), core);
+    data->self = out;
+    data.release();
+    return out;
+}
+
+VSNode *fieldsCreate(VSNode *clip, const d2vcontext *d2v, bool rff, int width, int height, VSCore *core, const VSAPI *vsapi, std::string& err)
+{
+    /* Allocate our private data. */
+    std::unique_ptr<rffData> data(new rffData());
 
-            data->fields.push_back(field);
-            data->fields.push_back(field);
+    data->node = vsapi->addNodeRef(clip);
+    data->vi   = *vsapi->getVideoInfo(data->node);
 
-            if (rff) {
-                data->fields.push_back(field);
-                data->fields.push_back(field);
+    if ((height / 2) % (1 << data->vi.format.subSamplingH)) {
+        err = "Fields: frame height must be divisible by twice the vertical chroma subsampling.";
+        vsapi->freeNode(data->node);
+        return NULL;
+    }
 
-                if (tff) {
-                    data->fields.push_back(field);
-                    data->fields.push_back(field);
-                }
-            }
+    rffBuildFieldMap(data.get(), d2v, rff);
+
+    /* Every field is a frame, at twice the frame rate. */
+    data->vi.width     = width;
+    data->vi.height    = height / 2;
+    data->vi.numFrames = (int) data->num_fields;
+    vsh::muldivRational(&data->vi.fpsNum, &data->vi.fpsDen, 2, 1);
+
+    VSFilterDependency deps[] = {data->node, rpGeneral};
+    VSNode *out = vsapi->createVideoFilter2("Fields", &data->vi, fieldsGetFrame, rffFree, fmParallel, deps, 1, data.get(), core);
+    data->self = out;
+    data.release();
+    return out;
+}
+
+/*
+ * Build the output frames for variable frame rate output. Coded progressive
+ * frames are output once, lasting as many fields as their flags say. Fields
+ * of interlaced frames are paired up in display order, the same way RFF
+ * application would, so only those sections are field matched; a field that
+ * can't be paired shows its whole source frame, for a single field's duration.
+ */
+static void vfrBuildFrameMap(vfrData *d, const d2vcontext *d2v)
+{
+    int64_t field = 0;
+
+    /* A field waiting for its pair. */
+    int pending         = -1;
+    bool pending_top    = false;
+    int64_t pending_pos = 0;
+
+    auto flush = [&]() {
+        if (pending < 0)
+            return;
+
+        d->frames.push_back({ pending, pending, !pending_top, 1, pending_pos });
+        pending = -1;
+    };
+
+    auto add_field = [&](int frame, bool top) {
+        if (pending >= 0 && pending_top != top) {
+            vfrFrame v;
+            v.top         = top ? frame : pending;
+            v.bottom      = top ? pending : frame;
+            v.bff         = !pending_top;
+            v.fields      = 2;
+            v.field_start = pending_pos;
+
+            d->frames.push_back(v);
+            pending = -1;
         } else {
-            /* Repeat fields. */
+            flush();
+
+            pending     = frame;
+            pending_top = top;
+            pending_pos = field;
+        }
+
+        field++;
+    };
+
+    for (int i = 0; i < d->vi.numFrames; i++) {
+        uint8_t code = rffFrameCode(d2v, i, true);
 
-            rffField first_field, second_field;
-            first_field.frame = second_field.frame = i;
-            first_field.type = tff ? Top : Bottom;
-            second_field.type = tff ? Bottom : Top;
+        frame f = d2v->frames[i];
+        bool progressive_frame = !!(d2v->gops[f.gop].flags[f.offset] & FRAME_FLAG_PROGRESSIVE);
 
-            data->fields.push_back(first_field);
-            data->fields.push_back(second_field);
+        if (code & RFF_CODE_PROGRESSIVE) {
+            flush();
 
-            if (rff)
-                data->fields.push_back(first_field);
+            int count = 2;
+            if (code & RFF_CODE_RFF)
+                count += (code & RFF_CODE_TFF) ? 4 : 2;
+
+            d->frames.push_back({ i, i, false, count, field });
+            field += count;
+        } else if (progressive_frame) {
+            /*
+             * Soft telecined frames in an interlaced sequence: both
+             * fields come from the same picture, so show it once, for
+             * as long as the repeated field makes it last.
+             */
+            flush();
+
+            int count = (code & RFF_CODE_RFF) ? 3 : 2;
+
+            d->frames.push_back({ i, i, false, count, field });
+            field += count;
+        } else {
+            bool tff = !!(code & RFF_CODE_TFF);
+
+            add_field(i, tff);
+            add_field(i, !tff);
+            if (code & RFF_CODE_RFF)
+                add_field(i, tff);
         }
     }
 
-    data->vi.numFrames = (int)data->fields.size() / 2;
+    flush();
+
+    d->frames.shrink_to_fit();
+}
+
+/* Write a v2 timecodes file with the start time of every output frame. */
+static bool vfrWriteTimecodes(const vfrData *d, const char *timecodes, std::string& err)
+{
+    std::filesystem::path path = std::filesystem::u8path(timecodes);
+
+#ifdef _WIN32
+    std::unique_ptr<FILE, decltype(&fclose)> out(_wfopen(path.c_str(), L"w"), &fclose);
+#else
+    std::unique_ptr<FILE, decltype(&fclose)> out(fopen(path.c_str(), "w"), &fclose);
+#endif
+
+    if (!out) {
+        err  = "VFR: cannot open timecodes file: ";
+        err += timecodes;
+        return false;
+    }
+
+    fprintf(out.get(), "# timecode format v2\n");
+
+    for (const vfrFrame& v : d->frames) {
+        double ms = (1000.0 * d->field_num * v.field_start) / d->field_den;
+        fprintf(out.get(), "%.3f\n", ms);
+    }
+
+    if (fflush(out.get())) {
+        err  = "VFR: failed to write timecodes file: ";
+        err += timecodes;
+        return false;
+    }
+
+    return true;
+}
+
+VSNode *vfrCreate(VSNode *clip, const d2vcontext *d2v, const char *timecodes, VSCore *core, const VSAPI *vsapi, std::string& err)
+{
+    /* Allocate our private data. */
+    std::unique_ptr<vfrData> data(new vfrData());
+
+    data->node = vsapi->addNodeRef(clip);
+    data->vi   = *vsapi->getVideoInfo(data->node);
+
+    /* Every field lasts half a coded frame. */
+    data->field_num = data->vi.fpsDen;
+    data->field_den = data->vi.fpsNum * 2;
+
+    vfrBuildFrameMap(data.get(), d2v);
+
+    if (timecodes && !vfrWriteTimecodes(data.get(), timecodes, err)) {
+        vsapi->freeNode(data->node);
+        return NULL;
+    }
+
+    data->vi.numFrames = (int) data->frames.size();
+    data->vi.fpsNum    = 0;
+    data->vi.fpsDen    = 0;
 
     VSFilterDependency deps[] = {data->node, rpGeneral};
-    VSNode *out = vsapi->createVideoFilter2("ApplyRFF", &data->vi, rffGetFrame, rffFree, fmParallel, deps, 1, data.get(), core);
+    VSNode *out = vsapi->createVideoFilter2("VFR", &data->vi, vfrGetFrame, vfrFree, fmParallel, deps, 1, data.get(), core);
+    data->self = out;
     data.release();
     return out;
 }
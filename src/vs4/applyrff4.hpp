@@ -38,19 +38,60 @@ typedef enum rffFieldType {
 } rffFieldType;
 
 typedef struct rffField {
-    int frame; // Source frame for this field.
+    int frame; // Source frame for this field, relative to the start of its cadence period.
     rffFieldType type;
 } rffField;
 
+/*
+ * A run of coded frames that repeat the same field cadence, e.g. a steady
+ * 3:2 pulldown or plain interlaced video. Frames that don't repeat are
+ * stored as a segment with a single, longer period.
+ */
+typedef struct rffSegment {
+    int64_t field_start; // First output field covered by this segment.
+    int frame_start;     // First source frame covered by this segment.
+    int period_frames;   // Source frames per cadence period.
+    int period_fields;   // Output fields per cadence period.
+    size_t pattern;      // Index of the period's fields in rffData::patterns.
+} rffSegment;
+
 typedef struct rffData {
-    std::unique_ptr<d2vcontext> d2v;
-    std::vector<rffField> fields; // Output fields, in the order they are to be displayed.
+    std::vector<rffSegment> segments; // Cadence segments, sorted by field_start.
+    std::vector<rffField> patterns;   // Output fields of each segment's period, in display order.
+    int64_t num_fields;
 
     VSVideoInfo vi;
     VSNode *node;
+    const VSNode *self; // For removing it from d2v.Stats once freed.
 } rffData;
 
-VSNode *rffCreate(VSNode *clip, const char *input, VSCore *core, const VSAPI *vsapi);
+/*
+ * A variable frame rate output frame: either a coded progressive frame,
+ * shown once for as long as its flags say, or a pair of matched fields.
+ */
+typedef struct vfrFrame {
+    int top;             // Source frame of the top field.
+    int bottom;          // Source frame of the bottom field.
+    bool bff;            // Whether the bottom field is displayed first.
+    int fields;          // Display duration, in fields.
+    int64_t field_start; // First displayed field, for timestamps.
+} vfrFrame;
+
+typedef struct vfrData {
+    std::vector<vfrFrame> frames;
+
+    /* Duration of a single field. */
+    int64_t field_num;
+    int64_t field_den;
+
+    VSVideoInfo vi;
+    VSNode *node;
+    const VSNode *self; // For removing it from d2v.Stats once freed.
+} vfrData;
+
+VSNode *rffCreate(VSNode *clip, const d2vcontext *d2v, VSCore *core, const VSAPI *vsapi);
+VSNode *fieldsCreate(VSNode *clip, const d2vcontext *d2v, bool rff, int width, int height, VSCore *core, const VSAPI *vsapi, std::string& err);
+VSNode *vfrCreate(VSNode *clip, const d2vcontext *d2v, const char *timecodes, VSCore *core, const VSAPI *vsapi, std::string& err);
 
 }
 
@@ -20,8 +20,24 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <algorithm>
+#include <climits>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+#include <map>
+#include <mutex>
+
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/motion_vector.h>
+#include <libavutil/time.h>
+#include <libavutil/video_enc_params.h>
+}
 
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
@@ -31,58 +47,78 @@
 #include "decode.hpp"
 #include "directrender4.hpp"
 #include "applyrff4.hpp"
+#include "trace.hpp"
+
+/* How often to check a followed D2V for new GOPs, in milliseconds. */
+#define D2V_FOLLOW_POLL_MS 50
 
 namespace vs4 {
 
+/*
+ * Map of the nodes returned by Source to their instance data,
+ * so d2v.Stats() can find the counters of a given clip.
+ */
+static std::mutex stats_lock;
+static std::map<const VSNode *, d2vData *> stats_nodes;
+
+/*
+ * Source nodes by d2vShareKey. Each Source call that uses one gets a
+ * d2vShareData node referencing it, and the entry is removed once the
+ * last of those is freed, while the source node is still referenced.
+ * So an entry that can be found always has a live node.
+ */
+typedef struct d2vShared {
+    VSNode *node;
+    d2vData *instance;
+    int users;
+} d2vShared;
+
+static std::mutex shared_lock;
+static std::map<std::string, d2vShared> shared_sources;
+
+typedef struct d2vShareData {
+    VSNode *node;
+    const VSNode *self;
+    std::string key;
+} d2vShareData;
+
 d2vData::~d2vData() {
     if (frame) {
         av_frame_unref(frame);
         av_freep(&frame);
     }
-}
-
-static const VSFrame *VS_CC d2vGetVSFrame(int n, d2vData *d,
-    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    VSFrame *f;
-    std::string msg;
-
-    /* Unreference the previously decoded frame. */
-    av_frame_unref(d->frame);
 
-    int ret = decodeframe(n, d->d2v.get(), d->dec.get(), d->frame, msg);
-    if (ret < 0) {
-        vsapi->setFilterError(msg.c_str(), frameCtx);
-        return NULL;
-    }
+    /* Make sure the decoder is gone before the trace is written. */
+    dec.reset();
 
-    /* Grab our direct-rendered frame. */
-    const VSFrame *s = (const VSFrame *)d->frame->opaque;
-    if (!s) {
-        vsapi->setFilterError("Seek pattern broke d2vsource! Please send a sample.", frameCtx);
-        return NULL;
-    }
+    /* All buffers are back once the decoder is gone. */
+    for (VSData *userdata : vsdata_free)
+        delete userdata;
 
-    /* If our width and height are the same, just return it. */
-    if (d->vi.width == d->aligned_width && d->vi.height == d->aligned_height) {
-        f = vsapi->copyFrame(s, core);
-    } else {
-        f = vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, NULL, core);
+    if (tracing)
+        tracestop();
+}
 
-        /* Copy into VS's buffers. */
-        for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
-            uint8_t *dstp = vsapi->getWritePtr(f, plane);
-            const uint8_t *srcp = vsapi->getReadPtr(s, plane);
-            ptrdiff_t dst_stride = vsapi->getStride(f, plane);
-            ptrdiff_t src_stride = vsapi->getStride(s, plane);
-            int width = vsapi->getFrameWidth(f, plane);
-            int height = vsapi->getFrameHeight(f, plane);
+/*
+ * Describe the planes of an output frame for the disk cache. Frames that
+ * are only written to the cache may share their data, so are only read.
+ */
+static void d2vDiskFrame(VSFrame *f, bool writable, const d2vData *d, const VSAPI *vsapi, diskcacheframe *df)
+{
+    df->num_planes = d->vi.format.numPlanes;
+    df->pict_type  = AV_PICTURE_TYPE_NONE;
 
-            vsh::bitblt(dstp, dst_stride, srcp, src_stride, width * d->vi.format.bytesPerSample, height);
-        }
+    for (int plane = 0; plane < df->num_planes; plane++) {
+        df->data[plane]     = writable ? vsapi->getWritePtr(f, plane) : const_cast<uint8_t *>(vsapi->getReadPtr(f, plane));
+        df->stride[plane]   = vsapi->getStride(f, plane);
+        df->row_size[plane] = vsapi->getFrameWidth(f, plane) * d->vi.format.bytesPerSample;
+        df->height[plane]   = vsapi->getFrameHeight(f, plane);
     }
+}
 
-    VSMap *props = vsapi->getFramePropertiesRW(f);
-
+/* Set the properties of output frame n, which decoded as pict_type. */
+static void d2vSetProps(VSMap *props, int n, int pict_type, const d2vData *d, const VSAPI *vsapi)
+{
     /*
      * The DGIndex manual simply says:
      *     "The matrix field displays the currently applicable matrix_coefficients value (colorimetry)."
@@ -95,7 +131,7 @@ static const VSFrame *VS_CC d2vGetVSFrame(int n, d2vData *d,
     vsapi->mapSetFloat(props, "_AbsoluteTime",
         (static_cast<double>(d->d2v->fps_den) * n) / static_cast<double>(d->d2v->fps_num), maReplace);
 
-    switch (d->frame->pict_type) {
+    switch (pict_type) {
     case AV_PICTURE_TYPE_I:
         vsapi->mapSetData(props, "_PictType", "I", 1, dtUtf8, maReplace);
         break;
@@ -116,22 +152,288 @@ static const VSFrame *VS_CC d2vGetVSFrame(int n, d2vData *d,
         fieldbased = 1 + !!(d->d2v->gops[d->d2v->frames[n].gop].flags[d->d2v->frames[n].offset] & FRAME_FLAG_TFF);
     vsapi->mapSetInt(props, "_FieldBased", fieldbased, maReplace);
 
-    vsapi->mapSetInt(props, "_ChromaLocation", d->d2v->mpeg_type == 1 ? 1 : 0, maReplace);
+    if (!d->gray) {
+        int mpeg_type = d->d2v->segments[d->d2v->gops[d->d2v->frames[n].gop].segment].mpeg_type;
+        vsapi->mapSetInt(props, "_ChromaLocation", mpeg_type == 1 ? 1 : 0, maReplace);
+    }
+}
+
+/*
+ * Attach the motion vectors libavcodec exported for the decoded picture,
+ * scaled to output pixels, leaving out blocks that are cropped away.
+ * libavcodec already puts the vectors of field macroblocks and field
+ * pictures in frame coordinates.
+ */
+static void d2vSetMotionVectors(VSMap *props, d2vData *d, const VSAPI *vsapi)
+{
+    const AVFrameSideData *sd = av_frame_get_side_data(d->frame, AV_FRAME_DATA_MOTION_VECTORS);
+    const AVMotionVector *mvs = sd ? (const AVMotionVector *) sd->data : NULL;
+    size_t count = sd ? sd->size / sizeof(AVMotionVector) : 0;
+    int shift    = d->dec->opts.lowres;
+
+    d->mvs.clear();
+
+    for (size_t i = 0; i < count; i++) {
+        const AVMotionVector& mv = mvs[i];
+        int x = mv.dst_x >> shift;
+        int y = mv.dst_y >> shift;
+
+        if (x < 0 || y < 0 || x >= d->vi.width || y >= d->vi.height)
+            continue;
+
+        int64_t scale = (int64_t) (mv.motion_scale ? mv.motion_scale : 1) << shift;
+
+        d2vMotionVector v;
+        v.dst_x    = (int16_t) x;
+        v.dst_y    = (int16_t) y;
+        v.motion_x = (int16_t) (mv.motion_x * 4 / scale);
+        v.motion_y = (int16_t) (mv.motion_y * 4 / scale);
+        v.w        = (uint8_t) std::max(mv.w >> shift, 1);
+        v.h        = (uint8_t) std::max(mv.h >> shift, 1);
+        v.source   = mv.source < 0 ? -1 : 1;
+        v.reserved = 0;
+
+        d->mvs.push_back(v);
+    }
+
+    vsapi->mapSetData(props, "D2VMotionVectors", d->mvs.empty() ? "" : (const char *) d->mvs.data(),
+                      (int) (d->mvs.size() * sizeof(d2vMotionVector)), dtBinary, maReplace);
+}
+
+/*
+ * Attach the quantizer of every macroblock of the decoded picture, as a
+ * grid of bytes covering the output frame. Blocks are 16x16 pixels in
+ * the coded picture, and smaller in draft mode.
+ */
+static void d2vSetQP(VSMap *props, d2vData *d, const VSAPI *vsapi)
+{
+    const AVFrameSideData *sd = av_frame_get_side_data(d->frame, AV_FRAME_DATA_VIDEO_ENC_PARAMS);
+    if (!sd)
+        return;
+
+    AVVideoEncParams *par = (AVVideoEncParams *) sd->data;
+
+    int block  = std::max(16 >> d->dec->opts.lowres, 1);
+    int width  = (d->vi.width + block - 1) / block;
+    int height = (d->vi.height + block - 1) / block;
+
+    /* Pictures with a single quantizer have no blocks. */
+    d->qp.assign((size_t) width * height, (uint8_t) std::clamp(par->qp, 0, 255));
+
+    for (unsigned int i = 0; i < par->nb_blocks; i++) {
+        const AVVideoBlockParams *b = av_video_enc_params_block(par, i);
+        uint8_t qp = (uint8_t) std::clamp(par->qp + b->delta_qp, 0, 255);
+
+        for (int y = b->src_y / 16; y < std::min((b->src_y + b->h + 15) / 16, height); y++)
+            for (int x = b->src_x / 16; x < std::min((b->src_x + b->w + 15) / 16, width); x++)
+                d->qp[(size_t) y * width + x] = qp;
+    }
+
+    vsapi->mapSetData(props, "D2VQP", (const char *) d->qp.data(), (int) d->qp.size(), dtBinary, maReplace);
+    vsapi->mapSetInt(props, "D2VQPWidth", width, maReplace);
+    vsapi->mapSetInt(props, "D2VQPHeight", height, maReplace);
+    vsapi->mapSetInt(props, "D2VQPBlockSize", block, maReplace);
+
+    if (par->type == AV_VIDEO_ENC_PARAMS_MPEG2)
+        vsapi->mapSetData(props, "D2VQPType", "mpeg2", -1, dtUtf8, maReplace);
+    else if (par->type == AV_VIDEO_ENC_PARAMS_H264)
+        vsapi->mapSetData(props, "D2VQPType", "h264", -1, dtUtf8, maReplace);
+}
+
+/* Wrap the decoded frame n in a VS frame, and set its properties. */
+static VSFrame *d2vOutputFrame(int n, d2vData *d, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    VSFrame *f;
+
+    /* Grab our direct-rendered frame. */
+    const VSFrame *s = (const VSFrame *)d->frame->opaque;
+    if (!s) {
+        vsapi->setFilterError("Seek pattern broke d2vsource! Please send a sample.", frameCtx);
+        return NULL;
+    }
+
+    int64_t copy_time = av_gettime_relative();
+
+    /*
+     * If our width and height are the same, just return it. In gray mode,
+     * only the luma plane is referenced.
+     */
+    if (d->vi.width == d->aligned_width && d->vi.height == d->aligned_height) {
+        if (d->gray) {
+            const VSFrame *plane_src[1] = { s };
+            const int planes[1] = { 0 };
+            f = vsapi->newVideoFrame2(&d->vi.format, d->vi.width, d->vi.height, plane_src, planes, NULL, core);
+        } else {
+            f = vsapi->copyFrame(s, core);
+        }
+    } else {
+        tracespan span("crop");
+        f = vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, NULL, core);
+
+        /* Copy into VS's buffers. */
+        for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
+            uint8_t *dstp = vsapi->getWritePtr(f, plane);
+            const uint8_t *srcp = vsapi->getReadPtr(s, plane);
+            ptrdiff_t dst_stride = vsapi->getStride(f, plane);
+            ptrdiff_t src_stride = vsapi->getStride(s, plane);
+            int width = vsapi->getFrameWidth(f, plane);
+            int height = vsapi->getFrameHeight(f, plane);
+
+            vsh::bitblt(dstp, dst_stride, srcp, src_stride, width * d->vi.format.bytesPerSample, height);
+        }
+    }
+
+    d->dec->stats.copy_time += av_gettime_relative() - copy_time;
+
+    VSMap *props = vsapi->getFramePropertiesRW(f);
+
+    d2vSetProps(props, n, d->frame->pict_type, d, vsapi);
+
+    if (d->stats_props) {
+        vsapi->mapSetInt(props, "D2VSeek", d->dec->last_seek, maReplace);
+        vsapi->mapSetInt(props, "D2VDiscarded", d->dec->last_discarded, maReplace);
+        vsapi->mapSetInt(props, "D2VDecodeTime", d->dec->last_decode_time, maReplace);
+    }
+
+    if (d->dec->opts.export_mvs)
+        d2vSetMotionVectors(props, d, vsapi);
+
+    if (d->dec->opts.export_qp)
+        d2vSetQP(props, d, vsapi);
+
+    return f;
+}
+
+static const VSFrame *VS_CC d2vGetVSFrame(int n, d2vData *d,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    /* Unreference the previously decoded frame. */
+    av_frame_unref(d->frame);
+
+    int ret = decodeframe(n, d->d2v.get(), d->dec.get(), d->frame, d->msg);
+    if (ret < 0) {
+        vsapi->setFilterError(d->msg.c_str(), frameCtx);
+        return NULL;
+    }
+
+    VSFrame *f = d2vOutputFrame(n, d, frameCtx, core, vsapi);
+
+    if (f && d->disk) {
+        diskcacheframe df;
+        d2vDiskFrame(f, false, d, vsapi, &df);
+        df.pict_type = d->frame->pict_type;
+
+        tracespan span("diskcachewrite");
+        diskcachewrite(d->disk.get(), n, &df);
+    }
+
+    return f;
+}
+
+/* Look frame n up in the disk cache, and return it if found. */
+static const VSFrame *d2vGetCachedFrame(int n, d2vData *d, VSCore *core, const VSAPI *vsapi)
+{
+    tracespan span("diskcacheread");
+    int64_t read_time = av_gettime_relative();
+
+    VSFrame *f = vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, NULL, core);
+
+    diskcacheframe df;
+    d2vDiskFrame(f, true, d, vsapi, &df);
+
+    if (!diskcacheread(d->disk.get(), n, &df)) {
+        vsapi->freeFrame(f);
+        return NULL;
+    }
+
+    VSMap *props = vsapi->getFramePropertiesRW(f);
+
+    d2vSetProps(props, n, df.pict_type, d, vsapi);
+
+    if (d->stats_props) {
+        vsapi->mapSetInt(props, "D2VSeek", 0, maReplace);
+        vsapi->mapSetInt(props, "D2VDiscarded", 0, maReplace);
+        vsapi->mapSetInt(props, "D2VDecodeTime", av_gettime_relative() - read_time, maReplace);
+    }
 
     return f;
 }
 
+/*
+ * Wait until frame n has been indexed, when following a D2V which
+ * is still being written.
+ */
+static bool d2vFollow(int n, d2vData *d, std::string& err)
+{
+    int64_t deadline = av_gettime_relative() + (int64_t) d->follow * 1000000;
+
+    while (1) {
+        if (decodefollow(d->d2v.get(), d->dec.get(), err) < 0)
+            return false;
+
+        if (n < (int) d->d2v->frames.size())
+            return true;
+
+        if (d->d2v->finished) {
+            err = "Source: frame is past the end of the followed D2V.";
+            return false;
+        }
+
+        if (av_gettime_relative() >= deadline) {
+            err = "Source: timed out waiting for frame to be indexed.";
+            return false;
+        }
+
+        av_usleep(D2V_FOLLOW_POLL_MS * 1000);
+    }
+}
+
 static const VSFrame *VS_CC d2vGetFrame(int n, int activationReason, void *instanceData, void **frameData,
                                     VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
 {
     d2vData *d = (d2vData *) instanceData;
     if (activationReason == arInitial) {
+        d->dec->stats.frames_requested++;
+
+        if (d->follow && n >= (int) d->d2v->frames.size()) {
+            std::string msg;
+
+            if (!d2vFollow(n, d, msg)) {
+                vsapi->setFilterError(msg.c_str(), frameCtx);
+                return NULL;
+            }
+        }
+
+        /* A frame from the disk cache saves a seek and a decode. */
+        if (d->disk) {
+            const VSFrame *f = d2vGetCachedFrame(n, d, core, vsapi);
+            if (f) {
+                d->disk_hits++;
+                d->dec->stats.frames_returned++;
+                return f;
+            }
+        }
+
         if (d->last_decoded < n && d->last_decoded > n - d->linear_threshold) {
             for (int i = d->last_decoded + 1; i < n; i++) {
+                /*
+                 * Under a memory budget, frames that wouldn't fit in the
+                 * cache are still decoded, to keep decoding linear, but
+                 * not output.
+                 */
+                if (d->max_ahead && i < n - d->max_ahead) {
+                    av_frame_unref(d->frame);
+                    if (decodeframe(i, d->d2v.get(), d->dec.get(), d->frame, d->msg) < 0) {
+                        vsapi->setFilterError(d->msg.c_str(), frameCtx);
+                        return NULL;
+                    }
+                    continue;
+                }
+
                 const VSFrame *f = d2vGetVSFrame(i, d, frameCtx, core, vsapi);
                 if (f) {
                     vsapi->cacheFrame(f, i, frameCtx);
                     vsapi->freeFrame(f);
+                    d->dec->stats.frames_predecoded++;
                 } else {
                     return NULL;
                 }
@@ -139,7 +441,41 @@ static const VSFrame *VS_CC d2vGetFrame(int n, int activationReason, void *insta
         }
 
         d->last_decoded = n;
-        return d2vGetVSFrame(n, d, frameCtx, core, vsapi);
+
+        const VSFrame *f = d2vGetVSFrame(n, d, frameCtx, core, vsapi);
+        if (f)
+            d->dec->stats.frames_returned++;
+
+        return f;
+    }
+
+    return NULL;
+}
+
+static const VSFrame *VS_CC d2vGetKeyFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    d2vData *d = (d2vData *) instanceData;
+    if (activationReason == arInitial) {
+        int source = d->keyframes[n];
+
+        d->dec->stats.frames_requested++;
+
+        av_frame_unref(d->frame);
+
+        int ret = decodekeyframe(d->d2v->frames[source].gop, d->d2v.get(), d->dec.get(), d->frame, d->msg);
+        if (ret < 0) {
+            vsapi->setFilterError(d->msg.c_str(), frameCtx);
+            return NULL;
+        }
+
+        VSFrame *f = d2vOutputFrame(source, d, frameCtx, core, vsapi);
+        if (f) {
+            vsapi->mapSetInt(vsapi->getFramePropertiesRW(f), "D2VSourceFrame", source, maReplace);
+            d->dec->stats.frames_returned++;
+        }
+
+        return f;
     }
 
     return NULL;
@@ -148,10 +484,84 @@ static const VSFrame *VS_CC d2vGetFrame(int n, int activationReason, void *insta
 static void VS_CC d2vFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
 {
     d2vData *d = (d2vData *) instanceData;
+
+    {
+        std::lock_guard<std::mutex> lock(stats_lock);
+
+        for (auto it = stats_nodes.begin(); it != stats_nodes.end();) {
+            if (it->second == d)
+                it = stats_nodes.erase(it);
+            else
+                ++it;
+        }
+    }
+
     delete d;
 }
 
-void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi)
+static void registerStatsNode(const VSNode *node, d2vData *d)
+{
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats_nodes[node] = d;
+}
+
+/*
+ * A shared source outlives the nodes each Source call registered on top
+ * of it, so those remove themselves, before their address can be reused.
+ */
+void unregisterStatsNode(const VSNode *node)
+{
+    std::lock_guard<std::mutex> lock(stats_lock);
+    stats_nodes.erase(node);
+}
+
+static void fnv1a(uint64_t& hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *) data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+}
+
+/*
+ * Identify the decoded frames of a source, for the disk cache: every
+ * input D2V by path, size and modification time, plus everything that
+ * changes what the output frames look like.
+ */
+static uint64_t d2vCacheKey(const VSMap *in, const d2vData *d, int first, int last, int draft, const VSAPI *vsapi)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int num_inputs = vsapi->mapNumElements(in, "input");
+
+    for (int i = 0; i < num_inputs; i++) {
+        std::error_code ec;
+        const char *input = vsapi->mapGetData(in, "input", i, 0);
+        std::filesystem::path path = std::filesystem::absolute(std::filesystem::u8path(input), ec);
+        std::string name = path.u8string();
+        uintmax_t size = std::filesystem::file_size(path, ec);
+        int64_t mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+
+        fnv1a(hash, name.c_str(), name.size() + 1);
+        fnv1a(hash, &size, sizeof(size));
+        fnv1a(hash, &mtime, sizeof(mtime));
+    }
+
+    int params[] = {
+        first, last, draft, d->gray, d->vi.width, d->vi.height,
+        d->vi.format.colorFamily, d->vi.format.bitsPerSample, d->vi.format.subSamplingW, d->vi.format.subSamplingH
+    };
+    fnv1a(hash, params, sizeof(params));
+
+    return hash;
+}
+
+/*
+ * Create the node that decodes, and outputs coded frames, with the
+ * options that change what is decoded. Returns NULL on error.
+ */
+static VSNode *d2vCreateSource(const VSMap *in, VSMap *out, VSCore *core, const VSAPI *vsapi, d2vData **instance)
 {
     std::string msg;
     int err;
@@ -163,24 +573,170 @@ void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core,
 
     if (threads < 0) {
         vsapi->mapSetError(out, "Invalid number of threads.");
-        return;
+        return NULL;
+    }
+
+    /* Memory budget for the whole source, in MiB. */
+    int64_t max_memory = vsapi->mapGetInt(in, "max_memory", 0, &err);
+    if (err)
+        max_memory = 0;
+
+    if (max_memory < 0) {
+        vsapi->mapSetError(out, "Source: max_memory can't be negative.");
+        return NULL;
     }
 
     /* Allocate our private data. */
     std::unique_ptr<d2vData> data(new d2vData());
 
+    data->max_memory = max_memory << 20;
+
     data->last_decoded = -1;
 
-    data->d2v.reset(d2vparse(vsapi->mapGetData(in, "input", 0, 0), msg));
-    if (!data->d2v) {
-        vsapi->mapSetError(out, msg.c_str());
-        return;
+    /* Start tracing before anything else, so parsing is traced as well. */
+    const char *trace_path = vsapi->mapGetData(in, "trace", 0, &err);
+    if (err)
+        trace_path = getenv("D2V_TRACE");
+
+    if (trace_path && *trace_path) {
+        if (!tracestart(trace_path, msg)) {
+            vsapi->mapSetError(out, msg.c_str());
+            return NULL;
+        }
+        data->tracing = true;
+    }
+
+    /* Only index and decode the requested range of frames. */
+    int first = vsapi->mapGetIntSaturated(in, "first", 0, &err);
+    if (err)
+        first = 0;
+
+    int last = vsapi->mapGetIntSaturated(in, "last", 0, &err);
+    if (err)
+        last = -1;
+
+    /*
+     * Multiple D2V files are appended into a single clip, and
+     * share one decoder.
+     */
+    int num_inputs = vsapi->mapNumElements(in, "input");
+
+    if (num_inputs > 1 && (first || last >= 0)) {
+        vsapi->mapSetError(out, "Source: first and last can't be used with multiple inputs.");
+        return NULL;
+    }
+
+    /*
+     * Follow a D2V that is still being written, e.g. by a live capture.
+     * Only complete GOPs are indexed, and the rest are picked up as
+     * frames past them are requested.
+     */
+    data->follow = vsapi->mapGetIntSaturated(in, "follow", 0, &err);
+    if (err)
+        data->follow = 0;
+
+    if (data->follow < 0) {
+        vsapi->mapSetError(out, "Source: follow can't be negative.");
+        return NULL;
+    } else if (data->follow && num_inputs > 1) {
+        vsapi->mapSetError(out, "Source: follow can't be used with multiple inputs.");
+        return NULL;
+    }
+
+    for (int i = 0; i < num_inputs; i++) {
+        std::unique_ptr<d2vcontext> d2v(d2vparse(vsapi->mapGetData(in, "input", i, 0), msg, first, last, !!data->follow));
+        if (!d2v) {
+            vsapi->mapSetError(out, msg.c_str());
+            return NULL;
+        }
+
+        if (!i) {
+            data->d2v = std::move(d2v);
+        } else if (!d2vappend(data->d2v.get(), d2v.get(), msg)) {
+            vsapi->mapSetError(out, msg.c_str());
+            return NULL;
+        }
+    }
+
+    /*
+     * Draft decoding. Reduced size decoding is only supported by the
+     * MPEG-1/2 decoder, so H.264 only gets the faster, non-compliant
+     * decoding paths, and its loop filter skipped.
+     */
+    int draft = vsapi->mapGetIntSaturated(in, "draft", 0, &err);
+    if (err)
+        draft = 0;
+
+    if (draft < 0 || draft > 3) {
+        vsapi->mapSetError(out, "Source: draft must be between 0 and 3.");
+        return NULL;
+    }
+
+    data->gray = !!vsapi->mapGetInt(in, "gray", 0, &err);
+
+    /* Demuxed packets to keep around for re-seeks, in MiB. */
+    int64_t packet_cache = vsapi->mapGetInt(in, "packet_cache", 0, &err);
+    if (err)
+        packet_cache = 0;
+
+    if (packet_cache < 0) {
+        vsapi->mapSetError(out, "Source: packet_cache can't be negative.");
+        return NULL;
+    }
+
+    decodeoptions opts = {};
+    opts.gray              = data->gray;
+    opts.fast              = draft > 0;
+    opts.packet_cache_size = packet_cache << 20;
+    opts.prefilter         = !!vsapi->mapGetInt(in, "prefilter", 0, &err);
+    opts.io_hints          = !!vsapi->mapGetInt(in, "iohints", 0, &err);
+    opts.export_mvs        = !!vsapi->mapGetInt(in, "mvs", 0, &err);
+    opts.export_qp         = !!vsapi->mapGetInt(in, "qp", 0, &err);
+
+    /* Frames read back from disk have no side data to export. */
+    if ((opts.export_mvs || opts.export_qp) && vsapi->mapNumElements(in, "cache_dir") > 0) {
+        vsapi->mapSetError(out, "Source: cache_dir can't be used with mvs or qp.");
+        return NULL;
+    }
+
+    bool has_h264 = false;
+    for (const d2vsegment& seg : data->d2v->segments)
+        has_h264 |= seg.mpeg_type == 264;
+
+    if (!has_h264)
+        opts.lowres = draft;
+
+    /*
+     * The decoder keeps its reference frames, plus one frame per thread,
+     * and we keep the last decoded frame around.
+     */
+    int reserved_frames = (has_h264 ? 17 : 3) + 1;
+
+    /*
+     * Under a memory budget, limit the number of frame threads so the
+     * decoder's buffers take up at most half of it. The chroma format
+     * isn't known before decoding, so assume 8-bit 4:2:0.
+     */
+    if (data->max_memory) {
+        int64_t estimate = (int64_t) FFALIGN(AV_CEIL_RSHIFT(data->d2v->width, opts.lowres), 16) *
+                           FFALIGN(AV_CEIL_RSHIFT(data->d2v->height, opts.lowres), 32) * 3 / 2;
+        int max_threads  = (int) std::min<int64_t>(data->max_memory / 2 / estimate - reserved_frames, INT_MAX);
+
+        if (max_threads < 1) {
+            vsapi->mapSetError(out, "Source: max_memory is too small for this video.");
+            return NULL;
+        }
+
+        if (!threads)
+            threads = av_cpu_count();
+
+        threads = std::min(threads, max_threads);
     }
 
-    data->dec.reset(decodeinit(data->d2v.get(), threads, msg));
+    data->dec.reset(decodeinit(data->d2v.get(), threads, msg, &opts));
     if (!data->dec) {
         vsapi->mapSetError(out, msg.c_str());
-        return;
+        return NULL;
     }
 
     /*
@@ -191,11 +747,18 @@ void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core,
     data->dec->avctx->get_buffer2    = VSGetBuffer;
 
     data->vi.numFrames = (int) data->d2v->frames.size();
-    data->vi.width     = data->d2v->width;
-    data->vi.height    = data->d2v->height;
+    data->vi.width     = AV_CEIL_RSHIFT(data->d2v->width, opts.lowres);
+    data->vi.height    = AV_CEIL_RSHIFT(data->d2v->height, opts.lowres);
     data->vi.fpsNum    = data->d2v->fps_num;
     data->vi.fpsDen    = data->d2v->fps_den;
 
+    /*
+     * A followed D2V has no known length, so the clip is as long as it
+     * can be, unless last is set.
+     */
+    if (data->follow)
+        data->vi.numFrames = last >= 0 ? last - first + 1 : INT_MAX;
+
     /* Stash the pointer to our core. */
     data->core = core;
     data->api  = vsapi;
@@ -207,59 +770,423 @@ void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core,
     data->aligned_width  = FFALIGN(data->vi.width, 16);
     data->aligned_height = FFALIGN(data->vi.height, 32);
 
+    /*
+     * libavcodec exports at most 8 motion vectors per macroblock, so
+     * room for them all means exporting them never allocates.
+     */
+    if (opts.export_mvs)
+        data->mvs.reserve((size_t) FFALIGN(data->d2v->width, 16) / 16 * FFALIGN(data->d2v->height, 32) / 16 * 8);
+
     data->frame = av_frame_alloc();
     if (!data->frame) {
         vsapi->mapSetError(out, "Cannot allocate AVFrame.");
-        return;
+        return NULL;
     }
 
     /*
      * Decode 1 frame to find out how the chroma is subampled.
      * The first time our custom get_buffer is called, it will
-     * fill in data->vi.format.
+     * fill in data->dr_format.
      */
     data->format_set = false;
     err              = decodeframe(0, data->d2v.get(), data->dec.get(), data->frame, msg);
     if (err < 0) {
         msg.insert(0, "Failed to decode test frame: ");
         vsapi->mapSetError(out, msg.c_str());
-        return;
+        return NULL;
     }
 
     if (!data->format_set) {
         vsapi->mapSetError(out, "Source: video has unsupported pixel format.");
-        return;
+        return NULL;
     }
 
+    /* All direct-rendered buffers have the same size. */
+    const VSFrame *test_frame = (const VSFrame *) data->frame->opaque;
+    for (int plane = 0; plane < data->dr_format.numPlanes; plane++)
+        data->frame_size += vsapi->getStride(test_frame, plane) * vsapi->getFrameHeight(test_frame, plane);
+
+    /* In gray mode, only the luma plane is output. */
+    if (data->gray)
+        vsapi->queryVideoFormat(&data->vi.format, cfGray, stInteger, data->dr_format.bitsPerSample, 0, 0, core);
+    else
+        data->vi.format = data->dr_format;
+
     /* See if nocrop is enabled, and set the width/height accordingly. */
     bool no_crop = !!vsapi->mapGetInt(in, "nocrop", 0, &err);
 
-    if (no_crop) {
+    /*
+     * When outputting fields, the uncropped frames are passed on as-is, and
+     * cropping is done while the fields are copied out of them.
+     */
+    bool fields = !!vsapi->mapGetInt(in, "fields", 0, &err);
+
+    if (no_crop || fields) {
         data->vi.width  = data->aligned_width;
         data->vi.height = data->aligned_height;
     }
 
+    data->stats_props = !!vsapi->mapGetInt(in, "stats", 0, &err);
+
+    /*
+     * The rest of the budget goes to cached output frames, split between
+     * our own cache and that of ApplyRFF or Fields, if used. This also
+     * limits how many frames are decoded ahead.
+     */
+    int cache_frames = 0;
+    if (data->max_memory) {
+        int64_t decoder_memory = (threads + reserved_frames) * data->frame_size;
+        int64_t cache_memory   = std::max<int64_t>(data->max_memory - decoder_memory, 0);
+
+        cache_frames    = (int) std::max<int64_t>(cache_memory / data->frame_size / 2, 1);
+        data->max_ahead = cache_frames;
+    }
+
+    data->cache_frames = cache_frames;
+
+    /*
+     * In keyframe mode, output one frame per GOP: the first one that can
+     * be decoded without the previous GOP, which is normally its I-frame.
+     */
+    if (vsapi->mapGetInt(in, "keyframes", 0, &err)) {
+        const d2vcontext *d2v = data->d2v.get();
+
+        for (int i = 0; i < (int) d2v->frames.size(); i++) {
+            const gop& g = d2v->gops[d2v->frames[i].gop];
+            int n = 0;
+
+            if (!(g.info & GOP_FLAG_CLOSED)) {
+                while (n < (int) g.flags.size() && !(g.flags[n] & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP))
+                    n++;
+
+                if (n == (int) g.flags.size())
+                    n = 0;
+            }
+
+            if (d2v->frames[i].offset == n)
+                data->keyframes.push_back(i);
+        }
+
+        if (data->keyframes.empty()) {
+            vsapi->mapSetError(out, "Source: no keyframes in clip.");
+            return NULL;
+        }
+
+        data->vi.numFrames = (int) data->keyframes.size();
+
+        VSNode *knode = vsapi->createVideoFilter2("d2vsource", &data->vi, d2vGetKeyFrame, d2vFree, fmUnordered, nullptr, 0, data.get(), core);
+        if (cache_frames)
+            vsapi->setCacheOptions(knode, 1, cache_frames * 2, -1);
+        *instance = data.release();
+
+        return knode;
+    }
+
+    /* Set up the disk cache, if enabled. */
+    const char *cache_dir = vsapi->mapGetData(in, "cache_dir", 0, &err);
+    if (!err && *cache_dir) {
+        int64_t cache_size = vsapi->mapGetInt(in, "cache_size", 0, &err);
+        if (err)
+            cache_size = 4096;
+
+        if (cache_size <= 0) {
+            vsapi->mapSetError(out, "Source: cache_size must be positive.");
+            return NULL;
+        }
+
+        uint64_t key = d2vCacheKey(in, data.get(), first, last, draft, vsapi);
+
+        data->disk.reset(diskcacheinit(cache_dir, key, cache_size << 20, msg));
+        if (!data->disk) {
+            vsapi->mapSetError(out, msg.c_str());
+            return NULL;
+        }
+    }
+
     VSNode *snode = vsapi->createVideoFilter2("d2vsource", &data->vi, d2vGetFrame, d2vFree, fmUnordered, nullptr, 0, data.get(), core);
     data->linear_threshold = vsapi->setLinearFilter(snode);
-    data.release();
+    if (cache_frames)
+        vsapi->setCacheOptions(snode, 1, cache_frames, -1);
+    *instance = data.release();
+
+    return snode;
+}
+
+/*
+ * Build the string identifying a source node: the inputs, and every
+ * option except those applied after decoding. Sources with the same
+ * one share a node, so they share its decoder and frame cache too.
+ */
+static std::string d2vShareKey(const VSMap *in, VSCore *core, const VSAPI *vsapi)
+{
+    static const char *post_decode[] = { "rff", "fields", "vfr", "timecodes", "nocrop", "share" };
+
+    /* Only whether the frames are cropped matters for the source. */
+    int err;
+    bool uncropped = vsapi->mapGetInt(in, "nocrop", 0, &err) || vsapi->mapGetInt(in, "fields", 0, &err);
+
+    std::string key = std::to_string((uintptr_t) core) + (uncropped ? " uncropped" : " cropped");
+
+    for (int i = 0; i < vsapi->mapNumKeys(in); i++) {
+        const char *name = vsapi->mapGetKey(in, i);
+
+        if (std::find_if(std::begin(post_decode), std::end(post_decode),
+                         [name](const char *p) { return !strcmp(p, name); }) != std::end(post_decode))
+            continue;
+
+        key += '\n';
+        key += name;
+
+        for (int j = 0; j < vsapi->mapNumElements(in, name); j++) {
+            key += '\0';
+
+            if (vsapi->mapGetType(in, name) == ptInt)
+                key += std::to_string(vsapi->mapGetInt(in, name, j, 0));
+            else
+                key.append(vsapi->mapGetData(in, name, j, 0), vsapi->mapGetDataSize(in, name, j, 0));
+        }
+    }
+
+    return key;
+}
+
+static const VSFrame *VS_CC d2vShareGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                             VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    d2vShareData *d = (d2vShareData *) instanceData;
+
+    if (activationReason == arInitial)
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    else if (activationReason == arAllFramesReady)
+        return vsapi->getFrameFilter(n, d->node, frameCtx);
+
+    return NULL;
+}
+
+static void VS_CC d2vShareFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
+{
+    d2vShareData *d = (d2vShareData *) instanceData;
 
+    unregisterStatsNode(d->self);
+
+    /* Nobody can look the source up anymore once its last user is gone. */
+    {
+        std::lock_guard<std::mutex> lock(shared_lock);
+
+        auto it = shared_sources.find(d->key);
+        if (it != shared_sources.end() && --it->second.users == 0)
+            shared_sources.erase(it);
+    }
+
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
+/*
+ * Wrap a shared source node for one Source call, taking over the given
+ * reference. Its entry must already count this call as a user.
+ */
+static VSNode *d2vShareNode(VSNode *node, const std::string& key, VSCore *core, const VSAPI *vsapi)
+{
+    d2vShareData *data = new d2vShareData();
+    data->node = node;
+    data->key  = key;
+
+    VSFilterDependency deps[] = {data->node, rpStrictSpatial};
+    VSNode *out = vsapi->createVideoFilter2("Source", vsapi->getVideoInfo(data->node), d2vShareGetFrame, d2vShareFree,
+                                            fmParallel, deps, 1, data, core);
+    data->self = out;
+
+    /* The source node has a cache of its own. */
+    vsapi->setCacheMode(out, cmForceDisable);
+
+    return out;
+}
+
+void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi)
+{
+    std::string msg;
+    int err;
+
+    /*
+     * When outputting fields, the uncropped frames are passed on as-is, and
+     * cropping is done while the fields are copied out of them.
+     */
+    bool no_crop   = !!vsapi->mapGetInt(in, "nocrop", 0, &err);
+    bool fields    = !!vsapi->mapGetInt(in, "fields", 0, &err);
+    bool vfr       = !!vsapi->mapGetInt(in, "vfr", 0, &err);
+    bool keyframes = !!vsapi->mapGetInt(in, "keyframes", 0, &err);
+    bool follow    = !!vsapi->mapGetInt(in, "follow", 0, &err);
+
+    if (vfr && fields) {
+        vsapi->mapSetError(out, "Source: fields can't be used with vfr.");
+        return;
+    }
+
+    if (!vfr && vsapi->mapNumElements(in, "timecodes") > 0) {
+        vsapi->mapSetError(out, "Source: timecodes requires vfr.");
+        return;
+    }
+
+    if (keyframes && (fields || vfr)) {
+        vsapi->mapSetError(out, "Source: fields and vfr can't be used with keyframes.");
+        return;
+    }
+
+    /* Everything that needs the flags of all frames up front is out. */
     bool rff = !!vsapi->mapGetInt(in, "rff", 0, &err);
     if (err)
-        rff = true;
+        rff = !follow;
+
+    if (follow && (rff || fields || vfr || keyframes)) {
+        vsapi->mapSetError(out, "Source: rff, fields, vfr and keyframes can't be used with follow.");
+        return;
+    }
+
+    if (follow && vsapi->mapNumElements(in, "cache_dir") > 0) {
+        vsapi->mapSetError(out, "Source: cache_dir can't be used with follow.");
+        return;
+    }
+
+    /*
+     * Identical sources in a script share one node, and so one decoder
+     * and frame cache, with only the options above applied separately.
+     */
+    bool share = !!vsapi->mapGetInt(in, "share", 0, &err);
+    if (err)
+        share = true;
+
+    /*
+     * Keyframes are decoded one request at a time, so sharing their
+     * decoder would serialize every user of it.
+     */
+    if (keyframes)
+        share = false;
+
+    VSNode *snode     = NULL;
+    d2vData *instance = NULL;
+    bool shared       = false;
+    std::string key;
+
+    if (share) {
+        key = d2vShareKey(in, core, vsapi);
+
+        std::lock_guard<std::mutex> lock(shared_lock);
+
+        auto it = shared_sources.find(key);
+        if (it != shared_sources.end()) {
+            snode    = vsapi->addNodeRef(it->second.node);
+            instance = it->second.instance;
+            shared   = true;
+            it->second.users++;
+        }
+    }
+
+    if (!snode) {
+        snode = d2vCreateSource(in, out, core, vsapi, &instance);
+        if (!snode)
+            return;
+
+        /* If another call got there first, this source just isn't shared. */
+        if (share) {
+            std::lock_guard<std::mutex> lock(shared_lock);
+            shared = shared_sources.emplace(key, d2vShared{ snode, instance, 1 }).second;
+        }
+    }
 
-    if (rff) {
-        VSNode *rffnode = rffCreate(snode, vsapi->mapGetData(in, "input", 0, 0), core, vsapi);
+    if (shared)
+        snode = d2vShareNode(snode, key, core, vsapi);
+
+    if (keyframes) {
+        registerStatsNode(snode, instance);
+        vsapi->mapConsumeNode(out, "clip", snode, maReplace);
+        return;
+    }
+
+    int cache_frames = instance->cache_frames;
+    int crop_width   = no_crop ? instance->aligned_width : AV_CEIL_RSHIFT(instance->d2v->width, instance->dec->opts.lowres);
+    int crop_height  = no_crop ? instance->aligned_height : AV_CEIL_RSHIFT(instance->d2v->height, instance->dec->opts.lowres);
+
+    if (vfr) {
+        const char *timecodes = vsapi->mapGetData(in, "timecodes", 0, &err);
+        if (err || !*timecodes)
+            timecodes = NULL;
+
+        VSNode *vfrnode = vfrCreate(snode, instance->d2v.get(), timecodes, core, vsapi, msg);
         vsapi->freeNode(snode);
 
-        if (!rffnode) {
-            vsapi->mapSetError(out, "ApplyRFF: failed to parse d2v");
+        if (!vfrnode) {
+            vsapi->mapSetError(out, msg.c_str());
             return;
         }
 
+        if (cache_frames)
+            vsapi->setCacheOptions(vfrnode, 1, cache_frames, -1);
+
+        registerStatsNode(vfrnode, instance);
+        vsapi->mapConsumeNode(out, "clip", vfrnode, maReplace);
+    } else if (fields) {
+        VSNode *fieldsnode = fieldsCreate(snode, instance->d2v.get(), rff, crop_width, crop_height, core, vsapi, msg);
+        vsapi->freeNode(snode);
+
+        if (!fieldsnode) {
+            vsapi->mapSetError(out, msg.c_str());
+            return;
+        }
+
+        if (cache_frames)
+            vsapi->setCacheOptions(fieldsnode, 1, cache_frames, -1);
+
+        registerStatsNode(fieldsnode, instance);
+        vsapi->mapConsumeNode(out, "clip", fieldsnode, maReplace);
+    } else if (rff) {
+        VSNode *rffnode = rffCreate(snode, instance->d2v.get(), core, vsapi);
+        vsapi->freeNode(snode);
+
+        if (cache_frames)
+            vsapi->setCacheOptions(rffnode, 1, cache_frames, -1);
+
+        registerStatsNode(rffnode, instance);
         vsapi->mapConsumeNode(out, "clip", rffnode, maReplace);
     } else {
+        registerStatsNode(snode, instance);
         vsapi->mapConsumeNode(out, "clip", snode, maReplace);
     }
 }
 
+void VS_CC d2vStats(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi)
+{
+    VSNode *node = vsapi->mapGetNode(in, "clip", 0, 0);
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+
+    auto it = stats_nodes.find(node);
+    vsapi->freeNode(node);
+
+    if (it == stats_nodes.end()) {
+        vsapi->mapSetError(out, "Stats: clip must be returned directly by d2v.Source.");
+        return;
+    }
+
+    const decodestats& stats = it->second->dec->stats;
+
+    vsapi->mapSetInt(out, "frames_requested", stats.frames_requested, maReplace);
+    vsapi->mapSetInt(out, "frames_returned", stats.frames_returned, maReplace);
+    vsapi->mapSetInt(out, "frames_predecoded", stats.frames_predecoded, maReplace);
+    vsapi->mapSetInt(out, "frames_decoded", stats.frames_decoded, maReplace);
+    vsapi->mapSetInt(out, "frames_discarded", stats.frames_discarded, maReplace);
+    vsapi->mapSetInt(out, "seeks", stats.seeks, maReplace);
+    vsapi->mapSetInt(out, "packet_cache_hits", stats.packet_cache_hits, maReplace);
+    vsapi->mapSetInt(out, "reopens", stats.reopens, maReplace);
+    vsapi->mapSetInt(out, "bytes_read", stats.bytes_read, maReplace);
+    vsapi->mapSetInt(out, "open_time", stats.open_time, maReplace);
+    vsapi->mapSetInt(out, "probe_time", stats.probe_time, maReplace);
+    vsapi->mapSetInt(out, "decode_time", stats.decode_time, maReplace);
+    vsapi->mapSetInt(out, "copy_time", stats.copy_time, maReplace);
+    vsapi->mapSetInt(out, "memory_used", it->second->memory_used, maReplace);
+    vsapi->mapSetInt(out, "memory_peak", it->second->memory_peak, maReplace);
+    vsapi->mapSetInt(out, "memory_budget", it->second->max_memory, maReplace);
+    vsapi->mapSetInt(out, "disk_cache_hits", it->second->disk_hits, maReplace);
+}
+
 }
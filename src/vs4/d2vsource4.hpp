@@ -25,33 +25,102 @@
 
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "d2v.hpp"
 #include "decode.hpp"
+#include "diskcache.hpp"
 
 namespace vs4 {
 
+struct VSData;
+
+/*
+ * A motion vector in the D2VMotionVectors frame property. Positions and
+ * sizes are in output pixels, and the block is predicted from dst + motion.
+ */
+typedef struct d2vMotionVector {
+    int16_t dst_x;    // Center of the block.
+    int16_t dst_y;
+    int16_t motion_x; // In quarter pixels.
+    int16_t motion_y;
+    uint8_t w;
+    uint8_t h;
+    int8_t source;    // -1 if predicted from the previous reference frame, 1 if from the next one.
+    uint8_t reserved;
+} d2vMotionVector;
+
 typedef struct d2vData {
     std::unique_ptr<d2vcontext> d2v;
     std::unique_ptr<decodecontext> dec;
     AVFrame *frame;
     VSVideoInfo vi;
+    VSVideoFormat dr_format;
     VSCore *core;
     const VSAPI *api;
 
     int aligned_height;
     int aligned_width;
 
+    /* Source frame of every output frame, in keyframe mode. */
+    std::vector<int> keyframes;
+
     int last_decoded;
     int linear_threshold;
 
+    /*
+     * Memory used by direct-rendered buffers, in bytes, and the budget
+     * for the whole source. A budget of 0 means no limit.
+     */
+    std::atomic<int64_t> memory_used;
+    std::atomic<int64_t> memory_peak;
+    int64_t max_memory;
+    int64_t frame_size;
+
+    /* Decoded frames kept on disk across runs, if enabled. */
+    std::unique_ptr<diskcache> disk;
+    std::atomic<int64_t> disk_hits;
+
+    /* Most frames decoded ahead and cached at once, or 0 for no limit. */
+    int max_ahead;
+
+    /* Frames cached by each node under the memory budget, or 0 for the default. */
+    int cache_frames;
+
+    /* Seconds to wait for frames that aren't indexed yet, or 0 if not following. */
+    int follow;
+
+    /* Reused buffers for exported motion vectors and quantizers. */
+    std::vector<d2vMotionVector> mvs;
+    std::vector<uint8_t> qp;
+
+    /* Reused for decoding errors, so frame requests don't allocate a string. */
+    std::string msg;
+
+    /*
+     * Bookkeeping of direct-rendered buffers that have been released,
+     * for reuse. The decoder may get and release them from its threads.
+     */
+    std::mutex vsdata_lock;
+    std::vector<VSData *> vsdata_free;
+
     bool format_set;
+    bool gray;
+    bool stats_props;
+    bool tracing;
 
     ~d2vData();
 } d2vData;
 
 void VS_CC d2vCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
+void VS_CC d2vStats(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi);
+
+/* Stop d2v.Stats from finding a node, as it is freed. */
+void unregisterStatsNode(const VSNode *node);
 
 }
 
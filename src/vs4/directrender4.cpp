@@ -24,12 +24,15 @@
 #include <cstdint>
 #include <cstdlib>
 
+#include <mutex>
+
 extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
 #include "d2vsource4.hpp"
 #include "directrender4.hpp"
+#include "trace.hpp"
 
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
@@ -38,53 +41,85 @@ namespace vs4 {
 
 int VSGetBuffer(AVCodecContext *avctx, AVFrame *pic, int flag)
 {
+    tracespan span("VSGetBuffer");
     d2vData *data = (d2vData *) avctx->opaque;
 
+    VSVideoFormat format;
+
+    switch(avctx->pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        data->api->getVideoFormatByID(&format, pfYUV420P8, data->core);
+        break;
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        data->api->getVideoFormatByID(&format, pfYUV422P8, data->core);
+        break;
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        data->api->getVideoFormatByID(&format, pfYUV444P8, data->core);
+        break;
+    case AV_PIX_FMT_YUV420P9:
+        data->api->getVideoFormatByID(&format, pfYUV420P9, data->core);
+        break;
+    case AV_PIX_FMT_YUV422P9:
+        data->api->getVideoFormatByID(&format, pfYUV422P9, data->core);
+        break;
+    case AV_PIX_FMT_YUV444P9:
+        data->api->getVideoFormatByID(&format, pfYUV444P9, data->core);
+        break;
+    case AV_PIX_FMT_YUV420P10:
+        data->api->getVideoFormatByID(&format, pfYUV420P10, data->core);
+        break;
+    case AV_PIX_FMT_YUV422P10:
+        data->api->getVideoFormatByID(&format, pfYUV422P10, data->core);
+        break;
+    case AV_PIX_FMT_YUV444P10:
+        data->api->getVideoFormatByID(&format, pfYUV444P10, data->core);
+        break;
+    default:
+        return -1;
+    }
+
+    /*
+     * Every picture must match the format of the first one, since that is
+     * what the output clip and its frames were set up with. Joined D2V
+     * files may differ in chroma format, which the D2V doesn't record.
+     */
     if (!data->format_set) {
-        switch(avctx->pix_fmt) {
-        case AV_PIX_FMT_YUV420P:
-        case AV_PIX_FMT_YUVJ420P:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV420P8, data->core);
-            break;
-        case AV_PIX_FMT_YUV422P:
-        case AV_PIX_FMT_YUVJ422P:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV422P8, data->core);
-            break;
-        case AV_PIX_FMT_YUV444P:
-        case AV_PIX_FMT_YUVJ444P:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV444P8, data->core);
-            break;
-        case AV_PIX_FMT_YUV420P9:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV420P9, data->core);
-            break;
-        case AV_PIX_FMT_YUV422P9:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV422P9, data->core);
-            break;
-        case AV_PIX_FMT_YUV444P9:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV444P9, data->core);
-            break;
-        case AV_PIX_FMT_YUV420P10:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV420P10, data->core);
-            break;
-        case AV_PIX_FMT_YUV422P10:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV422P10, data->core);
-            break;
-        case AV_PIX_FMT_YUV444P10:
-            data->api->getVideoFormatByID(&data->vi.format, pfYUV444P10, data->core);
-            break;
-        default:
-            return -1;
-        }
+        data->dr_format  = format;
         data->format_set = true;
+    } else if (!vsh::isSameVideoFormat(&format, &data->dr_format)) {
+        return -1;
     }
 
-    VSData *userdata = new VSData();
+    /* Reuse the bookkeeping of a released buffer, if there is one. */
+    VSData *userdata = NULL;
+    {
+        std::lock_guard<std::mutex> lock(data->vsdata_lock);
+
+        if (!data->vsdata_free.empty()) {
+            userdata = data->vsdata_free.back();
+            data->vsdata_free.pop_back();
+        }
+    }
+
+    if (!userdata)
+        userdata = new VSData();
+
+    /*
+     * The frame and the AVBufferRef wrapping it are still allocated for
+     * every picture, by VapourSynth and FFmpeg.
+     */
     userdata->d2v      = (d2vData *) avctx->opaque;
-    userdata->vs_frame = data->api->newVideoFrame(&data->vi.format, data->aligned_width, data->aligned_height, NULL, data->core);
+    userdata->vs_frame = data->api->newVideoFrame(&data->dr_format, data->aligned_width, data->aligned_height, NULL, data->core);
 
     pic->buf[0] = av_buffer_create(NULL, 0, VSReleaseBuffer, userdata, 0);
-    if (!pic->buf[0])
+    if (!pic->buf[0]) {
+        data->api->freeFrame(userdata->vs_frame);
+        delete userdata;
         return -1;
+    }
 
     pic->opaque              = (void *) userdata->vs_frame;
     pic->extended_data       = pic->data;
@@ -93,11 +128,20 @@ int VSGetBuffer(AVCodecContext *avctx, AVFrame *pic, int flag)
     pic->format              = avctx->pix_fmt;
     pic->sample_aspect_ratio = avctx->sample_aspect_ratio;
 
-    for(int i = 0; i < data->vi.format.numPlanes; i++) {
+    userdata->size = 0;
+
+    for(int i = 0; i < data->dr_format.numPlanes; i++) {
         pic->data[i]     = data->api->getWritePtr(userdata->vs_frame, i);
         pic->linesize[i] = (int) data->api->getStride(userdata->vs_frame, i);
+
+        userdata->size += (int64_t) pic->linesize[i] * data->api->getFrameHeight(userdata->vs_frame, i);
     }
 
+    /* Account for the buffer, which the decoder may hold on to for a while. */
+    int64_t used = data->memory_used += userdata->size;
+    int64_t peak = data->memory_peak;
+    while (used > peak && !data->memory_peak.compare_exchange_weak(peak, used));
+
     return 0;
 }
 
@@ -105,8 +149,17 @@ void VSReleaseBuffer(void *opaque, uint8_t *data)
 {
     VSData *userdata = (VSData *) opaque;
 
-    userdata->d2v->api->freeFrame(userdata->vs_frame);
-    delete userdata;
+    d2vData *d = userdata->d2v;
+
+    d->memory_used -= userdata->size;
+    d->api->freeFrame(userdata->vs_frame);
+
+    /*
+     * The list only grows up to the most buffers ever held at once,
+     * so this stops allocating once decoding is under way.
+     */
+    std::lock_guard<std::mutex> lock(d->vsdata_lock);
+    d->vsdata_free.push_back(userdata);
 }
 
 }
\ No newline at end of file
@@ -34,6 +34,7 @@ namespace vs4 {
 typedef struct VSData {
     VSFrame *vs_frame;
     d2vData *d2v;
+    int64_t size;
 } VSData;
 
 int VSGetBuffer(AVCodecContext *avctx, AVFrame *pic, int flag);
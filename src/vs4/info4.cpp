@@ -0,0 +1,154 @@
+/*
+ * VapourSynth D2V Plugin
+ *
+ * Copyright (c) 2012 Derek Buitenhuis
+ *
+ * This file is part of d2vsource.
+ *
+ * d2vsource is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * d2vsource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with d2vsource; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <VapourSynth4.h>
+#include <VSHelper4.h>
+
+#include "d2v.hpp"
+#include "gop.hpp"
+#include "info4.hpp"
+
+namespace vs4 {
+
+static const VSFrame *VS_CC infoGetFrame(int n, int activationReason, void *instanceData, void **frameData,
+                                    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
+{
+    infoData *d = (infoData *) instanceData;
+
+    if (activationReason != arInitial)
+        return NULL;
+
+    const frame& f = d->d2v->frames[n];
+    const gop& g   = d->d2v->gops[f.gop];
+    uint8_t flags  = g.flags[f.offset];
+
+    VSFrame *dst = vsapi->copyFrame(d->blank, core);
+    VSMap *props = vsapi->getFramePropertiesRW(dst);
+
+    vsapi->mapSetInt(props, "_Matrix", g.matrix, maReplace);
+    vsapi->mapSetInt(props, "_DurationNum", d->d2v->fps_den, maReplace);
+    vsapi->mapSetInt(props, "_DurationDen", d->d2v->fps_num, maReplace);
+    vsapi->mapSetFloat(props, "_AbsoluteTime",
+        (static_cast<double>(d->d2v->fps_den) * n) / static_cast<double>(d->d2v->fps_num), maReplace);
+
+    int fieldbased;
+    if (flags & FRAME_FLAG_PROGRESSIVE)
+        fieldbased = 0;
+    else
+        fieldbased = 1 + !!(flags & FRAME_FLAG_TFF);
+    vsapi->mapSetInt(props, "_FieldBased", fieldbased, maReplace);
+
+    /* Per-frame flags. */
+    vsapi->mapSetInt(props, "D2VFlags", flags, maReplace);
+    vsapi->mapSetInt(props, "D2VRFF", !!(flags & FRAME_FLAG_RFF), maReplace);
+    vsapi->mapSetInt(props, "D2VTFF", !!(flags & FRAME_FLAG_TFF), maReplace);
+    vsapi->mapSetInt(props, "D2VProgressiveFrame", !!(flags & FRAME_FLAG_PROGRESSIVE), maReplace);
+    vsapi->mapSetInt(props, "D2VDecodableWithoutPreviousGOP", !!(flags & FRAME_FLAG_DECODABLE_WITHOUT_PREVIOUS_GOP), maReplace);
+
+    /* Info about the GOP the frame is in. */
+    vsapi->mapSetInt(props, "D2VGOP", f.gop, maReplace);
+    vsapi->mapSetInt(props, "D2VGOPOffset", f.offset, maReplace);
+    vsapi->mapSetInt(props, "D2VGOPInfo", g.info, maReplace);
+    vsapi->mapSetInt(props, "D2VClosedGOP", !!(g.info & GOP_FLAG_CLOSED), maReplace);
+    vsapi->mapSetInt(props, "D2VProgressiveSequence", !!(g.info & GOP_FLAG_PROGRESSIVE_SEQUENCE), maReplace);
+    vsapi->mapSetInt(props, "D2VFile", g.file, maReplace);
+    vsapi->mapSetInt(props, "D2VPosition", (int64_t) g.pos, maReplace);
+    vsapi->mapSetInt(props, "D2VVOB", g.vob, maReplace);
+    vsapi->mapSetInt(props, "D2VCell", g.cell, maReplace);
+    vsapi->mapSetInt(props, "D2VMPEGType", d->d2v->segments[g.segment].mpeg_type, maReplace);
+
+    return dst;
+}
+
+static void VS_CC infoFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
+{
+    infoData *d = (infoData *) instanceData;
+    vsapi->freeFrame(d->blank);
+    delete d;
+}
+
+void VS_CC infoCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi)
+{
+    std::string msg;
+    int err;
+
+    /* Allocate our private data. */
+    std::unique_ptr<infoData> data(new infoData());
+
+    int first = vsapi->mapGetIntSaturated(in, "first", 0, &err);
+    if (err)
+        first = 0;
+
+    int last = vsapi->mapGetIntSaturated(in, "last", 0, &err);
+    if (err)
+        last = -1;
+
+    int num_inputs = vsapi->mapNumElements(in, "input");
+
+    if (num_inputs > 1 && (first || last >= 0)) {
+        vsapi->mapSetError(out, "Info: first and last can't be used with multiple inputs.");
+        return;
+    }
+
+    /* Only the index is read. No decoder is ever opened. */
+    for (int i = 0; i < num_inputs; i++) {
+        std::unique_ptr<d2vcontext> d2v(d2vparse(vsapi->mapGetData(in, "input", i, 0), msg, first, last));
+        if (!d2v) {
+            vsapi->mapSetError(out, msg.c_str());
+            return;
+        }
+
+        if (!i) {
+            data->d2v = std::move(d2v);
+        } else if (!d2vappend(data->d2v.get(), d2v.get(), msg)) {
+            vsapi->mapSetError(out, msg.c_str());
+            return;
+        }
+    }
+
+    vsapi->getVideoFormatByID(&data->vi.format, pfGray8, core);
+    data->vi.numFrames = (int) data->d2v->frames.size();
+    data->vi.width     = data->d2v->width;
+    data->vi.height    = data->d2v->height;
+    data->vi.fpsNum    = data->d2v->fps_num;
+    data->vi.fpsDen    = data->d2v->fps_den;
+
+    VSFrame *blank   = vsapi->newVideoFrame(&data->vi.format, data->vi.width, data->vi.height, NULL, core);
+    uint8_t *dstp    = vsapi->getWritePtr(blank, 0);
+    ptrdiff_t stride = vsapi->getStride(blank, 0);
+
+    for (int y = 0; y < data->vi.height; y++)
+        memset(dstp + y * stride, 0, data->vi.width);
+
+    data->blank = blank;
+
+    VSNode *node = vsapi->createVideoFilter2("Info", &data->vi, infoGetFrame, infoFree, fmParallel, nullptr, 0, data.get(), core);
+    data.release();
+
+    vsapi->mapConsumeNode(out, "clip", node, maReplace);
+}
+
+}
@@ -27,11 +27,14 @@
 #include <VSHelper4.h>
 
 #include "d2vsource4.hpp"
+#include "info4.hpp"
 
 using namespace vs4;
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
     vspapi->configPlugin("com.sources.d2vsource", "d2v", "D2V Source", VS_MAKE_VERSION(1, 4), VAPOURSYNTH_API_VERSION, 0, plugin);
 
-    vspapi->registerFunction("Source", "input:data;threads:int:opt;nocrop:int:opt;rff:int:opt;", "clip:vnode;", d2vCreate, 0, plugin);
+    vspapi->registerFunction("Source", "input:data[];threads:int:opt;nocrop:int:opt;rff:int:opt;fields:int:opt;stats:int:opt;trace:data:opt;first:int:opt;last:int:opt;draft:int:opt;gray:int:opt;keyframes:int:opt;max_memory:int:opt;cache_dir:data:opt;cache_size:int:opt;packet_cache:int:opt;prefilter:int:opt;iohints:int:opt;mvs:int:opt;qp:int:opt;vfr:int:opt;timecodes:data:opt;follow:int:opt;share:int:opt;", "clip:vnode;", d2vCreate, 0, plugin);
+    vspapi->registerFunction("Info", "input:data[];first:int:opt;last:int:opt;", "clip:vnode;", infoCreate, 0, plugin);
+    vspapi->registerFunction("Stats", "clip:vnode;", "any", d2vStats, 0, plugin);
 }